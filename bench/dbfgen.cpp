@@ -0,0 +1,528 @@
+/*
+ * File:   dbfgen.cpp
+ *
+ * Writes synthetic prosheet.DBF files for the benchmarks, laid out with the
+ * DBFHEADER/DBFFIELD structures ordersync reads them with.
+ *
+ * The data is reproducible for a given --seed: a catalog of articles,
+ * colors and sizes (optionally written out as SQL for the sock tables),
+ * rows that mostly match it, some only after trim() and some not at all,
+ * plus the closed, blank, flagged and zero rows ordersync filters out.
+ * --change=PCT bumps the quantity of that share of rows, so a second file
+ * with the same seed exercises the update path.  --index=FILE also writes
+ * a Visual FoxPro .cdx with a BARCODE_ID tag, as cdxReader reads it.
+ */
+
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+#include "../src/dbf.h"
+
+using namespace std;
+
+// Trimmed variants ordersync should still find, through its trimmed item map
+static const char *const colors[] = {
+    "Black", "White", "Navy", "Grey", "Charcoal", "Red", "Burgundy", "Pink", "Blue", "Sky",
+    "Green", "Olive", "Khaki", "Brown", "Beige", "Cream", "Yellow", "Orange", "Purple", "Lilac"
+};
+static const char *const sizes[] = {
+    "9-11", "10-12", "12-14", "S", "M", "L", "XL", "FREE"
+};
+#define COLORCOUNT (sizeof (colors) / sizeof (colors[0]))
+#define SIZECOUNT (sizeof (sizes) / sizeof (sizes[0]))
+
+struct gen_field {
+    const char *name;
+    char type;
+    int length;
+    int decimals;
+};
+
+static gen_field prosheetFields[] = {
+    { "ORDERNO", 'C', 10, 0},
+    { "CUSTVAR", 'C', 20, 0},
+    { "ARTCONO", 'C', 12, 0},
+    { "ARTICLE", 'C', 30, 0},
+    { "COLORWAY", 'C', 20, 0},
+    { "SIZE", 'C', 8, 0},
+    { "ORDDATE", 'D', 8, 0},
+    { "EXFDATE", 'D', 8, 0},
+    { "BARCODE_ID", 'C', 8, 0},
+    { "ORDERQTY", 'N', 10, 2},
+    { "QUOTAQTY", 'N', 10, 2},
+    { "PANTYCHK", 'L', 1, 0},
+    { "YCONLY", 'L', 1, 0},
+    { "CLOSECHK", 'L', 1, 0},
+    { "KNIPROD", 'C', 10, 0}
+};
+#define FIELDCOUNT (sizeof (prosheetFields) / sizeof (prosheetFields[0]))
+
+// xorshift64*, so a seed means the same file everywhere
+static uint64_t rngState;
+
+static uint64_t rnd() {
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return rngState * 0x2545F4914F6CDD1DULL;
+}
+
+static int percent() {
+    return rnd() % 100;
+}
+
+static void put(string &record, const gen_field &field, const string &value) {
+    string v = value.substr(0, field.length);
+
+    if (field.type == 'N') {
+        record.append(field.length - v.length(), ' ');
+        record += v;
+    } else {
+        record += v;
+        record.append(field.length - v.length(), ' ');
+    }
+}
+
+static string format(const char *fmt, long value) {
+    char buf[64];
+
+    snprintf(buf, sizeof (buf), fmt, value);
+    return buf;
+}
+
+static string quantity(long hundredths) {
+    char buf[32];
+
+    snprintf(buf, sizeof (buf), "%ld.%02ld", hundredths / 100, hundredths % 100);
+    return buf;
+}
+
+// Compact index writer: nodes are filled front to back and each level is
+// written after the one below it, so children always precede their parent
+
+#define NODESIZE 512
+
+struct index_key {
+    string key; // blank padded to the key length
+    uint32_t recno; // 1 based
+};
+
+static void putLE(string &node, size_t pos, uint32_t value, int bytes) {
+    for (int b = 0; b < bytes; b++) {
+        node[pos + b] = (char) (value >> (8 * b));
+    }
+}
+
+static void putBE(string &node, size_t pos, uint32_t value) {
+    for (int b = 0; b < 4; b++) {
+        node[pos + b] = (char) (value >> (8 * (3 - b)));
+    }
+}
+
+static int bitsFor(uint32_t value) {
+    int bits = 1;
+
+    while (bits < 32 && (value >> bits) != 0) {
+        bits++;
+    }
+    return bits;
+}
+
+static string indexHeader(uint32_t root, size_t keylength, uint8_t options, const string &expression) {
+    string header(2 * NODESIZE, 0);
+
+    putLE(header, 0, root, 4);
+    putLE(header, 4, 0xFFFFFFFFU, 4);
+    putLE(header, 12, keylength, 2);
+    header[14] = options;
+    putLE(header, 510, expression.length() + 1, 2);
+    header.replace(NODESIZE, expression.length(), expression);
+    return header;
+}
+
+// Appends the tree of keys (sorted) to file, returning its root's offset
+static uint32_t writeTree(string &file, const vector<index_key> &keys, size_t keylength, uint32_t maxrecno) {
+    int dupbits = bitsFor(keylength);
+    int infolength = (bitsFor(maxrecno) + 2 * dupbits + 7) / 8;
+    int recbits = infolength * 8 - 2 * dupbits;
+    vector<index_key> level; // last key of every node on the level being built
+    vector<uint32_t> offsets;
+
+    // Leaves
+    for (size_t i = 0; i < keys.size() || offsets.empty();) {
+        string node(NODESIZE, 0);
+        size_t count = 0;
+        size_t keyend = NODESIZE;
+        const string *previous = NULL;
+
+        for (; i < keys.size(); i++) {
+            const string &key = keys[i].key;
+            size_t dup = 0;
+            size_t trail = 0;
+
+            while (previous != NULL && dup < keylength && (*previous)[dup] == key[dup]) {
+                dup++;
+            }
+            while (trail < keylength - dup && key[keylength - 1 - trail] == ' ') {
+                trail++;
+            }
+
+            size_t stored = keylength - dup - trail;
+            if (24 + (count + 1) * infolength + stored > keyend) {
+                break;
+            }
+            keyend -= stored;
+            node.replace(keyend, stored, key, dup, stored);
+
+            uint64_t packed = keys[i].recno | ((uint64_t) dup << recbits) | ((uint64_t) trail << (recbits + dupbits));
+            for (int b = 0; b < infolength; b++) {
+                node[24 + count * infolength + b] = (char) (packed >> (8 * b));
+            }
+            previous = &key;
+            count++;
+        }
+
+        node[0] = 2;
+        putLE(node, 2, count, 2);
+        putLE(node, 12, keyend - 24 - count * infolength, 2);
+        putLE(node, 14, recbits == 32 ? 0xFFFFFFFFU : (1U << recbits) - 1, 4);
+        node[18] = (char) ((1 << dupbits) - 1);
+        node[19] = (char) ((1 << dupbits) - 1);
+        node[20] = recbits;
+        node[21] = dupbits;
+        node[22] = dupbits;
+        node[23] = infolength;
+
+        offsets.push_back(file.length());
+        level.push_back(count > 0 ? keys[i - 1] : index_key());
+        file += node;
+    }
+
+    // Interior levels, until one node holds the level
+    size_t fanout = (NODESIZE - 12) / (keylength + 8);
+    while (true) {
+        for (size_t n = 0; n < offsets.size(); n++) {
+            putLE(file, offsets[n] + 4, n > 0 ? offsets[n - 1] : 0xFFFFFFFFU, 4);
+            putLE(file, offsets[n] + 8, n + 1 < offsets.size() ? offsets[n + 1] : 0xFFFFFFFFU, 4);
+        }
+        if (offsets.size() == 1) {
+            file[offsets[0]] |= 1; // root
+            return offsets[0];
+        }
+
+        vector<index_key> parents;
+        vector<uint32_t> parentOffsets;
+        for (size_t first = 0; first < offsets.size(); first += fanout) {
+            string node(NODESIZE, 0);
+            size_t count = min(fanout, offsets.size() - first);
+
+            putLE(node, 2, count, 2);
+            for (size_t c = 0; c < count; c++) {
+                size_t pos = 12 + c * (keylength + 8);
+
+                node.replace(pos, keylength, level[first + c].key);
+                putBE(node, pos + keylength, level[first + c].recno);
+                putBE(node, pos + keylength + 4, offsets[first + c]);
+            }
+            parentOffsets.push_back(file.length());
+            parents.push_back(level[first + count - 1]);
+            file += node;
+        }
+        level.swap(parents);
+        offsets.swap(parentOffsets);
+    }
+}
+
+static bool byKey(const index_key &a, const index_key &b) {
+    return a.key < b.key || (a.key == b.key && a.recno < b.recno);
+}
+
+// A .cdx with a single tag on field, over the records' keys
+static bool writeIndex(const string &filename, const char *field, vector<index_key> &keys, size_t keylength) {
+    string file(2 * NODESIZE, 0);
+    string name(field);
+    vector<index_key> tags(1);
+
+    sort(keys.begin(), keys.end(), byKey);
+    for (size_t i = 0; i < keys.size(); i++) {
+        keys[i].key.resize(keylength, ' ');
+    }
+
+    // The tag directory: its only key is the tag name, pointing at the tag header
+    uint32_t tagHeader = 2 * NODESIZE + NODESIZE;
+    name.resize(10, ' ');
+    tags[0].key = name;
+    tags[0].recno = tagHeader;
+    uint32_t directoryRoot = writeTree(file, tags, 10, tagHeader);
+
+    file += string(2 * NODESIZE, 0);
+    uint32_t tagRoot = writeTree(file, keys, keylength, keys.size());
+
+    file.replace(0, 2 * NODESIZE, indexHeader(directoryRoot, 10, 0x60, ""));
+    file.replace(tagHeader, 2 * NODESIZE, indexHeader(tagRoot, keylength, 0x20, field));
+
+    ofstream out(filename.c_str(), ios::binary);
+    out.write(file.data(), file.length());
+    out.close();
+    return !!out;
+}
+
+static string sqlList(const char *table, const char *columns, const vector<string> &names) {
+    string sql = string("INSERT INTO \"") + table + "\" (" + columns + ") VALUES ";
+
+    for (size_t i = 0; i < names.size(); i++) {
+        sql += (i > 0 ? ", (" : "(") + to_string(i + 1) + ", '" + names[i] + "')";
+    }
+    return sql + ";\n";
+}
+
+int main(int argc, char** argv) {
+    long rows = 100000;
+    int closed = 10;
+    bool foxpro = false;
+    int articles = 500;
+    int change = 0;
+    uint64_t seed = 1;
+    string catalog;
+    string index;
+    bool badopt = false;
+
+    // Options
+    //  --rows=N          - records to write
+    //  --closed=PCT      - share of records marked deleted
+    //  --foxpro          - 0x30 (Visual FoxPro) header with the 263 byte backlink area
+    //  --width=FIELD:N   - width of a C field, e.g. --width=artcono:20
+    //  --articles=N      - articles in the catalog (each in every color and size)
+    //  --change=PCT      - bump the quantity of that share of rows
+    //  --seed=N
+    //  --catalog=FILE    - also write the sock tables' rows as SQL
+    //  --index=FILE      - also write a .cdx with a BARCODE_ID tag
+    static struct option longopts[] = {
+        { "rows", required_argument, NULL, 'r'},
+        { "closed", required_argument, NULL, 'c'},
+        { "foxpro", no_argument, NULL, 'f'},
+        { "width", required_argument, NULL, 'w'},
+        { "articles", required_argument, NULL, 'a'},
+        { "change", required_argument, NULL, 'x'},
+        { "seed", required_argument, NULL, 's'},
+        { "catalog", required_argument, NULL, 'k'},
+        { "index", required_argument, NULL, 'i'},
+        { NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'r':
+                rows = atol(optarg);
+                break;
+            case 'c':
+                closed = atoi(optarg);
+                break;
+            case 'f':
+                foxpro = true;
+                break;
+            case 'w':
+            {
+                const char *colon = strchr(optarg, ':');
+                size_t f;
+
+                for (f = 0; colon != NULL && f < FIELDCOUNT; f++) {
+                    if (prosheetFields[f].type == 'C' && strncasecmp(prosheetFields[f].name, optarg, colon - optarg) == 0 &&
+                            prosheetFields[f].name[colon - optarg] == 0) {
+                        prosheetFields[f].length = atoi(colon + 1);
+                        break;
+                    }
+                }
+                if (colon == NULL || f == FIELDCOUNT || prosheetFields[f].length < 1 || prosheetFields[f].length > 254) {
+                    badopt = true;
+                }
+                break;
+            }
+            case 'a':
+                articles = atoi(optarg);
+                break;
+            case 'x':
+                change = atoi(optarg);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'k':
+                catalog = optarg;
+                break;
+            case 'i':
+                index = optarg;
+                break;
+            default:
+                badopt = true;
+        }
+    }
+
+    if (badopt || argc - optind != 1 || rows < 0 || articles < 1) {
+        cerr << "Usage: dbfgen [--rows=N] [--closed=PCT] [--foxpro] [--width=FIELD:N]... [--articles=N] [--change=PCT] [--seed=N] [--catalog=FILE] [--index=FILE] out.dbf" << endl;
+        return 1;
+    }
+
+    FILE *out = fopen(argv[optind], "wb");
+    if (out == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    // Header
+    DBFHEADER header;
+    size_t recordlength = 1;
+    size_t backlink = foxpro ? 263 : 0;
+    time_t now = time(NULL);
+    struct tm *today = localtime(&now);
+
+    for (size_t f = 0; f < FIELDCOUNT; f++) {
+        recordlength += prosheetFields[f].length;
+    }
+
+    memset(&header, 0, sizeof (header));
+    header.signature = foxpro ? 0x30 : 0x03;
+    header.year = today->tm_year;
+    header.month = today->tm_mon + 1;
+    header.day = today->tm_mday;
+    header.recordcount = littleint32_t((uint32_t) rows);
+    header.headerlength = littleint16_t((uint16_t) (sizeof (DBFHEADER) + FIELDCOUNT * sizeof (DBFFIELD) + 1 + backlink));
+    header.recordlength = littleint16_t((uint16_t) recordlength);
+    fwrite(&header, sizeof (header), 1, out);
+
+    for (size_t f = 0; f < FIELDCOUNT; f++) {
+        DBFFIELD field;
+
+        memset(&field, 0, sizeof (field));
+        memcpy(field.name, prosheetFields[f].name, strnlen(prosheetFields[f].name, XBASEFIELDNAMESIZE));
+        field.type = prosheetFields[f].type;
+        field.length = prosheetFields[f].length;
+        field.decimals = prosheetFields[f].decimals;
+        fwrite(&field, sizeof (field), 1, out);
+    }
+    fputc('\r', out);
+    for (size_t i = 0; i < backlink; i++) {
+        fputc(0, out);
+    }
+
+    // Records, one rng stream for the data and another for --change, so a
+    // changed file differs from the unchanged one only where intended
+    string record;
+    vector<index_key> keys;
+    size_t keylength = 0;
+    record.reserve(recordlength);
+    for (long i = 0; i < rows; i++) {
+        rngState = (seed + 1) * 0x9E3779B97F4A7C15ULL + i;
+        rnd();
+
+        int article = rnd() % articles;
+        int color = rnd() % COLORCOUNT;
+        int size = rnd() % SIZECOUNT;
+        int shape = percent();
+        string artcono = format("A%05ld", article + 1);
+        string colorway = colors[color];
+        string sizename = sizes[size];
+
+        if (shape < 5) { // not in the catalog
+            artcono = format("X%05ld", article + 1);
+        } else if (shape < 15) { // found only once trimmed
+            colorway += " (" + format("%ld", rnd() % 100) + ")";
+            sizename = " " + sizename;
+        }
+
+        long orderqty = (rnd() % 500 + 1) * 100;
+        long quotaqty = orderqty + (rnd() % 20) * 100;
+        int quantityShape = percent();
+        int flags = percent();
+
+        rngState = (seed + 1) * 0xC2B2AE3D27D4EB4FULL + i;
+        rnd();
+        if (percent() < change) {
+            orderqty += 100;
+        }
+
+        record.assign(1, percent() < closed ? '*' : ' ');
+        for (size_t f = 0; f < FIELDCOUNT; f++) {
+            const gen_field &field = prosheetFields[f];
+            string name = field.name;
+
+            if (name == "ORDERNO") {
+                put(record, field, format("PO%06ld", i / 20));
+            } else if (name == "CUSTVAR") {
+                put(record, field, format("CUSTOMER %03ld", (i / 20) % 150));
+            } else if (name == "ARTCONO") {
+                put(record, field, artcono);
+            } else if (name == "ARTICLE") {
+                put(record, field, "Sock " + artcono + " (" + colors[color] + ")");
+            } else if (name == "COLORWAY") {
+                put(record, field, colorway);
+            } else if (name == "SIZE") {
+                put(record, field, sizename);
+            } else if (name == "ORDDATE") {
+                put(record, field, format("2016%04ld", (i % 12 + 1) * 100 + i % 28 + 1));
+            } else if (name == "EXFDATE") {
+                put(record, field, i % 5 == 0 ? "" : format("2017%04ld", (i % 12 + 1) * 100 + i % 28 + 1));
+            } else if (name == "BARCODE_ID") {
+                if (!index.empty()) {
+                    index_key key = { format("%08ld", i).substr(0, field.length), (uint32_t) i + 1 };
+
+                    keys.push_back(key);
+                    keylength = field.length;
+                }
+                put(record, field, format("%08ld", i));
+            } else if (name == "ORDERQTY") {
+                put(record, field, quantityShape < 3 ? "" : quantityShape < 6 ? "0.00" : quantity(orderqty));
+            } else if (name == "QUOTAQTY") {
+                put(record, field, quantity(quotaqty));
+            } else if (name == "PANTYCHK") {
+                put(record, field, flags < 3 ? "T" : "F");
+            } else if (name == "YCONLY") {
+                put(record, field, flags >= 3 && flags < 6 ? "T" : "F");
+            } else if (name == "CLOSECHK") {
+                put(record, field, flags >= 90 ? "T" : "F");
+            } else if (name == "KNIPROD") {
+                put(record, field, flags >= 95 ? "" : format("K%06ld", i));
+            }
+        }
+        fwrite(record.data(), 1, record.length(), out);
+    }
+    fputc(0x1A, out);
+
+    if (fclose(out) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    if (!index.empty() && !writeIndex(index, "BARCODE_ID", keys, keylength)) {
+        cerr << "Can't write " << index << endl;
+        return 1;
+    }
+
+    if (!catalog.empty()) {
+        ofstream sql(catalog.c_str());
+        vector<string> names;
+
+        for (int a = 0; a < articles; a++) {
+            names.push_back(format("A%05ld", a + 1));
+        }
+        sql << sqlList("sock:article", "article_id, artcono", names);
+        sql << sqlList("sock:color", "color_id, name", vector<string>(colors, colors + COLORCOUNT));
+        sql << sqlList("sock:size", "size_id, name", vector<string>(sizes, sizes + SIZECOUNT));
+        sql << "INSERT INTO \"sock:item\" (item_id, article_id, color_id, size_id) "
+                "SELECT row_number() OVER (ORDER BY a.article_id, c.color_id, s.size_id), a.article_id, c.color_id, s.size_id "
+                "FROM \"sock:article\" a, \"sock:color\" c, \"sock:size\" s;\n";
+        if (!sql) {
+            cerr << "Can't write " << catalog << endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * File:   microbench.cpp
+ *
+ * Times the hot per-record calls of a sync over a prosheet.DBF file (make
+ * one with dbfgen): dbfReader::next() through stdio and through the
+ * mapping, getString(), a numeric column read a row and a batch at a time,
+ * the deleted/flag prefilter, getFieldIndex(), item lookups, string
+ * interning, and the trim(), flatten_key() and isoDate() helpers.
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+#include "../src/dbfPrefilter.h"
+#include "../src/dbfReader.h"
+#include "../src/itemIndex.h"
+#include "../src/stringPool.h"
+#include "../src/textUtil.h"
+
+using namespace std;
+
+// Keeps results alive so the optimizer can't drop the work being timed
+static volatile size_t sink;
+
+// Runs body (which reports how many operations it did) rounds times and
+// prints the best round's time per operation
+template <typename Body>
+static void bench(const char *name, int rounds, Body body) {
+    double best = 0;
+    size_t ops = 0;
+
+    for (int round = 0; round < rounds; round++) {
+        chrono::steady_clock::time_point started = chrono::steady_clock::now();
+        ops = body();
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - started).count();
+
+        if (round == 0 || ns < best) {
+            best = ns;
+        }
+    }
+
+    cout << left << setw(28) << name << right << setw(12) << ops << " ops "
+            << fixed << setprecision(2) << setw(10) << best / 1e6 << " ms "
+            << setw(10) << (ops > 0 ? best / ops : 0) << " ns/op" << endl;
+}
+
+static size_t scan(const string &filename, bool mapped) {
+    dbfReader reader;
+    size_t records = 0;
+
+    reader.open(filename, mapped);
+    while (reader.next()) {
+        records++;
+    }
+    reader.close();
+
+    return records;
+}
+
+int main(int argc, char** argv) {
+    int rounds = 5;
+    size_t calls = 1000000;
+    bool badopt = false;
+
+    // Options
+    //  --rounds=N - timed repetitions of each benchmark, the best one is reported
+    //  --calls=N  - calls per round for the benchmarks that don't walk the file
+    static struct option longopts[] = {
+        { "rounds", required_argument, NULL, 'r'},
+        { "calls", required_argument, NULL, 'c'},
+        { NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            case 'c':
+                calls = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                badopt = true;
+        }
+    }
+
+    if (badopt || argc - optind != 1 || rounds < 1) {
+        cerr << "Usage: microbench [--rounds=N] [--calls=N] prosheet.dbf" << endl;
+        return 1;
+    }
+
+    string filename(argv[optind]);
+    dbfReader reader;
+    reader.open(filename);
+
+    int artcono = reader.getFieldIndex("artcono");
+    int colorway = reader.getFieldIndex("colorway");
+    if (artcono < 0 || colorway < 0) {
+        cerr << filename << " has no artcono/colorway fields" << endl;
+        return 1;
+    }
+
+    bench("next (stdio)", rounds, [&]() {
+        return scan(filename, false);
+    });
+
+    bench("next (mmap)", rounds, [&]() {
+        return scan(filename, true);
+    });
+
+    bench("getString", rounds, [&]() {
+        size_t ops = 0;
+
+        reader.reset();
+        while (reader.next()) {
+            sink += reader.getString(artcono).length();
+            ops++;
+        }
+        return ops;
+    });
+
+    // One numeric column, a row at a time and projected a batch at a time
+    static const dbfFieldSpec qtySpec[1] = {
+        { "orderqty", "NFI", 0, -1}
+    };
+    dbfBoundField qty[1];
+    string layoutError;
+    if (reader.bind(qtySpec, 1, qty, layoutError)) {
+        bench("getInteger (row)", rounds, [&]() {
+            size_t ops = 0;
+            int64_t value;
+
+            reader.reset();
+            while (reader.next()) {
+                sink += reader.getInteger(qty[0], value) == DBFVALUE_OK ? value : 0;
+                ops++;
+            }
+            return ops;
+        });
+
+        bench("getIntegers (batch)", rounds, [&]() {
+            size_t ops = 0;
+            dbfBatch batch;
+            dbfColumn<int64_t> column;
+            vector<uint32_t> rows;
+
+            reader.reset();
+            while (reader.nextBatch(batch)) {
+                rows.resize(batch.rows);
+                for (size_t i = 0; i < batch.rows; i++) {
+                    rows[i] = i;
+                }
+                reader.getIntegers(batch, qty[0], rows, column);
+                for (size_t i = 0; i < batch.rows; i++) {
+                    sink += column.states[i] == DBFVALUE_OK ? column.values[i] : 0;
+                }
+                ops += batch.rows;
+            }
+            return ops;
+        });
+    }
+
+    // Deleted rows and set flags dropped a batch at a time
+    static const dbfFieldSpec flagSpecs[2] = {
+        { "pantychk", "LC", 1, -1},
+        { "yconly", "LC", 1, -1}
+    };
+    dbfBoundField flags[2];
+    if (reader.bind(flagSpecs, 2, flags, layoutError)) {
+        string name = string("getSurvivors (") + prefilterKernel() + ")";
+
+        bench(name.c_str(), rounds, [&]() {
+            size_t ops = 0;
+            dbfBatch batch;
+            vector<uint64_t> survivors;
+
+            reader.reset();
+            while (reader.nextBatch(batch)) {
+                reader.getSurvivors(batch, flags, 2, survivors);
+                for (size_t w = 0; w < survivors.size(); w++) {
+                    sink += __builtin_popcountll(survivors[w]);
+                }
+                ops += batch.rows;
+            }
+            return ops;
+        });
+    }
+
+    bench("getFieldIndex", rounds, [&]() {
+        static const char *const names[] = { "orderno", "BARCODE_ID", "kniprod", "nosuchfield" };
+
+        for (size_t i = 0; i < calls; i++) {
+            sink += reader.getFieldIndex(names[i & 3]);
+        }
+        return calls;
+    });
+
+    // The helpers get the values of real rows, cycling through the file
+    vector<string> colors;
+    reader.reset();
+    while (reader.next() && colors.size() < 4096) {
+        colors.push_back(reader.getString(colorway));
+    }
+    if (colors.empty()) {
+        colors.push_back("Black (matt) ");
+    }
+
+    // Half the colors are known as they are, the other half only once
+    // normalized, and a quarter of the lookups miss altogether
+    itemIndex items;
+    for (size_t i = 0; i < colors.size(); i++) {
+        items.add("A00042", i % 2 == 0 ? colors[i] : " " + colors[i] + " (old)", "9-11", i + 1);
+    }
+
+    bench("itemIndex::find", rounds, [&]() {
+        const string articles[2] = { "A00042", "B00042" };
+        const string size = "9-11";
+
+        for (size_t i = 0; i < calls; i++) {
+            dbfSlice key[3] = { stringSlice(articles[i % 4 == 3]), stringSlice(colors[i % colors.size()]), stringSlice(size) };
+            item_match match;
+
+            sink += items.find(key, match);
+        }
+        return calls;
+    });
+
+    // Mostly values the pool already holds, as with customers and order numbers
+    bench("stringPool::intern", rounds, [&]() {
+        stringPool strings;
+
+        for (size_t i = 0; i < calls; i++) {
+            sink += strings.intern(colors[i % colors.size()]);
+        }
+        return calls;
+    });
+
+    bench("trim", rounds, [&]() {
+        for (size_t i = 0; i < calls; i++) {
+            sink += trim(colors[i % colors.size()]).length();
+        }
+        return calls;
+    });
+
+    bench("flatten_key", rounds, [&]() {
+        for (size_t i = 0; i < calls; i++) {
+            sink += flatten_key("A00042", colors[i % colors.size()], "9-11").length();
+        }
+        return calls;
+    });
+
+    bench("isoDate", rounds, [&]() {
+        string date;
+
+        for (size_t i = 0; i < calls; i++) {
+            isoDate(date, 20160101 + (int32_t) (i % 1231));
+            sink += date.length();
+        }
+        return calls;
+    });
+
+    reader.close();
+    return 0;
+}
@@ -0,0 +1,45 @@
+-- The tables ordersync reads and writes, just enough of them for the
+-- end-to-end benchmark's throwaway database
+
+CREATE TABLE "sock:article" (
+    article_id integer PRIMARY KEY,
+    artcono character varying(64) NOT NULL
+);
+
+CREATE TABLE "sock:color" (
+    color_id integer PRIMARY KEY,
+    name character varying(64) NOT NULL
+);
+
+CREATE TABLE "sock:size" (
+    size_id integer PRIMARY KEY,
+    name character varying(64) NOT NULL
+);
+
+CREATE TABLE "sock:item" (
+    item_id integer PRIMARY KEY,
+    article_id integer NOT NULL REFERENCES "sock:article",
+    color_id integer NOT NULL REFERENCES "sock:color",
+    size_id integer NOT NULL REFERENCES "sock:size"
+);
+
+CREATE TABLE "production:order" (
+    id serial PRIMARY KEY,
+    name character varying(64) NOT NULL,
+    customer character varying(64) NOT NULL,
+    date date NOT NULL
+);
+
+CREATE TABLE "production:order_content" (
+    id serial PRIMARY KEY,
+    date date NOT NULL,
+    customer character varying(64) NOT NULL,
+    orderno character varying(64) NOT NULL,
+    item_id integer NOT NULL,
+    quantity integer NOT NULL,
+    quota integer NOT NULL,
+    barcode_id character varying(8) NOT NULL,
+    exfdate date
+);
+
+CREATE INDEX ON "production:order_content" (barcode_id);
@@ -0,0 +1,56 @@
+#!/bin/bash
+#
+# End-to-end sync benchmark against a throwaway PostgreSQL cluster
+# (initdb, pg_ctl, createdb and psql must be on the PATH).
+#
+# Usage: bench/syncbench.sh [rows] [ordersync options...]
+#   e.g. bench/syncbench.sh 250000 --mmap --batch=5000
+#
+# Three syncs are timed: into an empty order_content (all inserts), of the
+# same file again (all passes) and of a copy with 10% of the quantities
+# changed (updates).  The cluster runs with fsync off and is removed on exit.
+
+set -e
+
+ROWS=${1:-100000}
+shift || true
+OPTIONS=("$@")
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$BENCH")
+WORK=$(mktemp -d /tmp/ordersync-bench.XXXXXX)
+PORT=${SYNCBENCH_PORT:-54329}
+
+cleanup() {
+    pg_ctl -D "$WORK/data" -m immediate stop > /dev/null 2>&1 || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+initdb -D "$WORK/data" -A trust -U bench > /dev/null
+pg_ctl -D "$WORK/data" -l "$WORK/postgres.log" -w \
+    -o "-k $WORK -p $PORT -c listen_addresses='' -c fsync=off" start > /dev/null
+createdb -h "$WORK" -p "$PORT" -U bench bench
+
+"$BENCH/dbfgen" --rows="$ROWS" --catalog="$WORK/catalog.sql" "$WORK/prosheet.dbf"
+"$BENCH/dbfgen" --rows="$ROWS" --change=10 "$WORK/changed.dbf"
+psql -q -h "$WORK" -p "$PORT" -U bench -d bench -f "$BENCH/schema.sql" -f "$WORK/catalog.sql"
+echo "host=$WORK port=$PORT user=bench dbname=bench" > "$WORK/db.conf"
+
+# run LABEL DBF
+run() {
+    local started elapsed
+
+    started=$(date +%s.%N)
+    "$ROOT/ordersync" "${OPTIONS[@]}" "$WORK/db.conf" "$2" > "$WORK/run.log"
+    elapsed=$(echo "$(date +%s.%N) - $started" | bc)
+
+    printf "%-24s %8.3f s  " "$1" "$elapsed"
+    grep -E "Passed|Updated|Inserted|Deleted" "$WORK/run.log" | tr -s ' ' | tr '\n' ' '
+    echo
+}
+
+echo "ordersync ${OPTIONS[*]}, $ROWS rows"
+run "initial (inserts)" "$WORK/prosheet.dbf"
+run "unchanged (passes)" "$WORK/prosheet.dbf"
+run "10% changed (updates)" "$WORK/changed.dbf"
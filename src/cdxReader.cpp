@@ -0,0 +1,390 @@
+/*
+ * File:   cdxReader.cpp
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dbf.h"
+#include "cdxReader.h"
+
+// Sibling pointer of a node at the end of its level
+#define NONODE 0xFFFFFFFFU
+
+// Header layout, shared by the tag directory and every tag
+#define CDXROOT 0
+#define CDXKEYLENGTH 12
+#define CDXOPTIONS 14
+#define CDXDESCENDING 502
+#define CDXFORPOOL 506
+#define CDXKEYPOOL 510
+
+#define CDXOPTION_FOR 8
+#define CDXOPTION_COMPACT 32
+#define CDXOPTION_COMPOUND 64
+
+// Node layout
+#define CDXATTRIBUTES 0
+#define CDXKEYCOUNT 2
+#define CDXRIGHT 8
+#define CDXINTERIORKEYS 12
+#define CDXLEAFKEYS 24
+
+#define CDXNODE_LEAF 2
+
+// Deeper than any real tree, so a cycle in a corrupt file ends the walk
+#define CDXMAXDEPTH 64
+
+cdxReader::cdxReader() {
+    is_open = false;
+    mapbase = NULL;
+}
+
+cdxReader::cdxReader(string filename) {
+    is_open = false;
+    mapbase = NULL;
+    open(filename);
+}
+
+cdxReader::~cdxReader() {
+    if (is_open) {
+        close();
+    }
+}
+
+void cdxReader::open(string filename) {
+    struct stat st;
+    int fd;
+
+    fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("can't open " + filename + ": " + strerror(errno));
+    }
+    if (fstat(fd, &st)) {
+        string error = strerror(errno);
+        ::close(fd);
+        throw runtime_error("can't stat " + filename + ": " + error);
+    }
+    if ((size_t) st.st_size < 2 * CDXNODESIZE) {
+        ::close(fd);
+        throw runtime_error(filename + ": too short for an index header");
+    }
+
+    maplength = st.st_size;
+    mapbase = (char *) mmap(NULL, maplength, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapbase == MAP_FAILED) {
+        string error = strerror(errno);
+        mapbase = NULL;
+        ::close(fd);
+        throw runtime_error("can't map " + filename + ": " + error);
+    }
+    ::close(fd);
+
+    uint8_t options = mapbase[CDXOPTIONS];
+    if (!(options & CDXOPTION_COMPACT)) {
+        munmap(mapbase, maplength);
+        mapbase = NULL;
+        throw runtime_error(filename + ": not a compact index");
+    }
+    compound = (options & CDXOPTION_COMPOUND) != 0;
+
+    root = NONODE;
+    keylength = 0;
+    recnos.clear();
+    rightleaf = NONODE;
+    position = 0;
+    current = 0;
+    is_open = true;
+}
+
+void cdxReader::close() {
+    munmap(mapbase, maplength);
+    mapbase = NULL;
+    is_open = false;
+}
+
+const char *cdxReader::node(uint32_t offset) {
+    if (offset % CDXNODESIZE != 0 || (size_t) offset + CDXNODESIZE > maplength) {
+        throw runtime_error("corrupt index: node pointer out of the file");
+    }
+
+    return mapbase + offset;
+}
+
+// Decodes a leaf node.  Entry infos run forward from CDXLEAFKEYS, each
+// packing the record number, the bytes shared with the previous key and
+// the trailing blanks dropped; the rest of each key runs backward from the
+// end of the node.
+static bool decodeLeaf(const char *leaf, unsigned int keylength, vector<uint32_t> &recnos, string &keys) {
+    unsigned int count = (uint16_t) slittleint16_t(leaf + CDXKEYCOUNT);
+    uint32_t recmask = slittleint32_t(leaf + 14);
+    uint8_t dupmask = leaf[18];
+    uint8_t trailmask = leaf[19];
+    uint8_t recbits = leaf[20];
+    uint8_t dupbits = leaf[21];
+    unsigned int infolength = (uint8_t) leaf[23];
+    size_t keyend = CDXNODESIZE;
+
+    if (infolength == 0 || infolength > 8 || CDXLEAFKEYS + (size_t) count * infolength > CDXNODESIZE) {
+        return false;
+    }
+
+    recnos.resize(count);
+    keys.resize((size_t) count * keylength);
+    for (unsigned int i = 0; i < count; i++) {
+        const unsigned char *info = (const unsigned char *) leaf + CDXLEAFKEYS + i * infolength;
+        uint64_t packed = 0;
+
+        for (unsigned int b = 0; b < infolength; b++) {
+            packed |= (uint64_t) info[b] << (8 * b);
+        }
+
+        unsigned int dup = (packed >> recbits) & dupmask;
+        unsigned int trail = (packed >> (recbits + dupbits)) & trailmask;
+        if (dup + trail > keylength || (i == 0 && dup > 0)) {
+            return false;
+        }
+
+        size_t stored = keylength - dup - trail;
+        if (keyend - stored < CDXLEAFKEYS + (size_t) count * infolength) {
+            return false;
+        }
+        keyend -= stored;
+
+        char *key = &keys[(size_t) i * keylength];
+        if (dup > 0) {
+            memcpy(key, key - keylength, dup);
+        }
+        memcpy(key + dup, leaf + keyend, stored);
+        memset(key + dup + stored, ' ', trail);
+
+        recnos[i] = packed & recmask;
+    }
+
+    return true;
+}
+
+// Selects the tag whose header is at offset
+bool cdxReader::selectHeader(uint32_t offset, string &error) {
+    if (offset % CDXNODESIZE != 0 || (size_t) offset + 2 * CDXNODESIZE > maplength) {
+        error = "tag header out of the file";
+        return false;
+    }
+
+    const char *header = mapbase + offset;
+    uint8_t options = header[CDXOPTIONS];
+    size_t keypool = (uint16_t) slittleint16_t(header + CDXKEYPOOL);
+    size_t forpool = (uint16_t) slittleint16_t(header + CDXFORPOOL);
+
+    if ((uint16_t) slittleint16_t(header + CDXDESCENDING) != 0) {
+        error = "descending tags are not supported";
+        return false;
+    }
+
+    keylength = (uint16_t) slittleint16_t(header + CDXKEYLENGTH);
+    if (keylength == 0 || keylength > CDXNODESIZE - CDXINTERIORKEYS - 8) {
+        error = "bad key length";
+        return false;
+    }
+
+    // Expressions are NUL terminated in the pool, the FOR one after the key one
+    const char *pool = header + CDXNODESIZE;
+    keypool = min<size_t>(keypool, CDXNODESIZE);
+    expression.assign(pool, strnlen(pool, keypool));
+    filter.clear();
+    if (options & CDXOPTION_FOR) {
+        forpool = min(forpool, CDXNODESIZE - keypool);
+        filter.assign(pool + keypool, strnlen(pool + keypool, forpool));
+    }
+
+    root = slittleint32_t(header + CDXROOT);
+    node(root);
+    recnos.clear();
+    keys.clear();
+    rightleaf = NONODE;
+    position = 0;
+    current = 0;
+
+    return true;
+}
+
+vector<string> cdxReader::tagNames() {
+    vector<string> names;
+
+    if (!is_open) {
+        throw logic_error("index file is not loaded");
+    }
+    if (!compound) {
+        names.push_back("");
+        return names;
+    }
+
+    unsigned int namelength = (uint16_t) slittleint16_t(mapbase + CDXKEYLENGTH);
+    uint32_t offset = slittleint32_t(mapbase + CDXROOT);
+    vector<uint32_t> tagoffsets;
+    string tagkeys;
+
+    // Down the left edge of the directory, then along its leaves
+    for (int depth = 0; !((uint16_t) slittleint16_t(node(offset) + CDXATTRIBUTES) & CDXNODE_LEAF); depth++) {
+        if (depth == CDXMAXDEPTH) {
+            throw runtime_error("corrupt index: tag directory too deep");
+        }
+        offset = sbigint32_t(node(offset) + CDXINTERIORKEYS + namelength + 4);
+    }
+
+    for (size_t leaves = 0; offset != NONODE; leaves++) {
+        if (leaves > maplength / CDXNODESIZE || !decodeLeaf(node(offset), namelength, tagoffsets, tagkeys)) {
+            throw runtime_error("corrupt index: bad tag directory");
+        }
+        for (size_t i = 0; i < tagoffsets.size(); i++) {
+            string name = tagkeys.substr(i * namelength, namelength);
+
+            names.push_back(name.substr(0, name.find_last_not_of(string(" \0", 2)) + 1));
+        }
+        offset = slittleint32_t(node(offset) + CDXRIGHT);
+    }
+
+    return names;
+}
+
+bool cdxReader::selectTag(const string &name, string &error) {
+    if (!is_open) {
+        throw logic_error("index file is not loaded");
+    }
+
+    if (!compound) {
+        if (!name.empty()) {
+            error = "a single tag index has no tag " + name;
+            return false;
+        }
+        return selectHeader(0, error);
+    }
+
+    // The directory is a tag itself, its keys the tag names and its record
+    // numbers the offsets of their headers
+    string directoryError;
+    if (!selectHeader(0, directoryError)) {
+        error = "bad tag directory: " + directoryError;
+        return false;
+    }
+
+    first();
+    while (next()) {
+        dbfSlice tag = key();
+
+        if (tag.len == name.length() && strncasecmp(tag.ptr, name.data(), tag.len) == 0) {
+            return selectHeader(recnos[current], error);
+        }
+    }
+
+    root = NONODE;
+    error = "no tag " + name;
+    return false;
+}
+
+// The leaf where a search for target (NULL for the first key) ends up, or
+// NONODE when every key is smaller
+uint32_t cdxReader::descend(const string *target) {
+    uint32_t offset = root;
+
+    if (root == NONODE) {
+        throw logic_error("no index tag selected");
+    }
+
+    for (int depth = 0; depth < CDXMAXDEPTH; depth++) {
+        const char *n = node(offset);
+
+        if ((uint16_t) slittleint16_t(n + CDXATTRIBUTES) & CDXNODE_LEAF) {
+            return offset;
+        }
+
+        // Each interior key is the last key under its child
+        unsigned int count = (uint16_t) slittleint16_t(n + CDXKEYCOUNT);
+        size_t entrylength = keylength + 8;
+        unsigned int i = 0;
+
+        if (CDXINTERIORKEYS + (size_t) count * entrylength > CDXNODESIZE || count == 0) {
+            throw runtime_error("corrupt index: bad interior node");
+        }
+        if (target != NULL) {
+            while (i < count && memcmp(n + CDXINTERIORKEYS + i * entrylength, target->data(), keylength) < 0) {
+                i++;
+            }
+            if (i == count) {
+                return NONODE;
+            }
+        }
+        offset = sbigint32_t(n + CDXINTERIORKEYS + i * entrylength + keylength + 4);
+    }
+
+    throw runtime_error("corrupt index: tree too deep");
+}
+
+void cdxReader::loadLeaf(uint32_t offset) {
+    const char *leaf = node(offset);
+
+    if (!((uint16_t) slittleint16_t(leaf + CDXATTRIBUTES) & CDXNODE_LEAF) ||
+            !decodeLeaf(leaf, keylength, recnos, keys)) {
+        throw runtime_error("corrupt index: bad leaf node");
+    }
+    rightleaf = slittleint32_t(leaf + CDXRIGHT);
+    position = 0;
+}
+
+void cdxReader::first() {
+    loadLeaf(descend(NULL));
+}
+
+void cdxReader::seek(const string &key) {
+    string target = key.substr(0, keylength);
+    target.resize(keylength, ' ');
+
+    uint32_t leaf = descend(&target);
+    if (leaf == NONODE) {
+        recnos.clear();
+        rightleaf = NONODE;
+        position = 0;
+        return;
+    }
+
+    loadLeaf(leaf);
+    while (position < recnos.size() && memcmp(keys.data() + position * keylength, target.data(), keylength) < 0) {
+        position++;
+    }
+}
+
+bool cdxReader::next() {
+    // Empty leaves are skipped; the walk can't take more leaves than the file has
+    for (size_t leaves = 0; position >= recnos.size(); leaves++) {
+        if (rightleaf == NONODE) {
+            return false;
+        }
+        if (leaves > maplength / CDXNODESIZE) {
+            throw runtime_error("corrupt index: leaf chain loops");
+        }
+        loadLeaf(rightleaf);
+    }
+
+    current = position++;
+    return true;
+}
+
+dbfSlice cdxReader::key() {
+    dbfSlice slice = { keys.data() + current * keylength, keylength };
+
+    // Blanks, or the NULs some writers pad tag names with
+    while (slice.len > 0 && (slice.ptr[slice.len - 1] == ' ' || slice.ptr[slice.len - 1] == 0)) {
+        slice.len--;
+    }
+    return slice;
+}
+
+unsigned int cdxReader::record() {
+    return recnos[current] - 1;
+}
@@ -0,0 +1,98 @@
+/*
+ * File:   cdxReader.h
+ *
+ * Read-only access to Visual FoxPro compact indexes: a compound .cdx with
+ * any number of tags, or a single tag .idx.  Each tag is a B+ tree of 512
+ * byte nodes whose leaves hold prefix/suffix compressed keys with their
+ * record numbers and are chained left to right, so once positioned with
+ * first() or seek(), next() walks the records in key order.
+ *
+ * Keys are character keys compared bytewise, as machine collation stores
+ * them; descending tags are refused.  The file is mapped, and a node is
+ * only checked as far as a walk needs it.  A file that can't be read or a
+ * corrupt node throws runtime_error, so a bad index fails one sync rather
+ * than the whole --watch daemon.
+ */
+
+#ifndef CDXREADER_H
+#define CDXREADER_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "dbfReader.h"
+
+using namespace std;
+
+// Size of an index node, and of each half of a tag header
+#define CDXNODESIZE 512
+
+class cdxReader {
+private:
+    char *mapbase;
+    size_t maplength;
+    bool compound; /* .cdx: the header at 0 is the tag directory */
+
+    // Selected tag
+    uint32_t root;
+    unsigned int keylength;
+    string expression;
+    string filter; /* FOR expression, "" if none */
+
+    // Cursor: the current leaf, decoded
+    vector<uint32_t> recnos; /* 1 based, or tag header offsets in the tag directory */
+    string keys; /* keylength bytes per entry, blank padded */
+    uint32_t rightleaf; /* Right sibling of the current leaf, NONODE if none */
+    size_t position; /* Next entry of the current leaf */
+    size_t current; /* Entry next() stopped on */
+
+    bool is_open;
+
+public:
+    cdxReader();
+    cdxReader(string filename);
+    virtual ~cdxReader();
+
+    void open(string filename);
+    void close();
+
+    // Tag names as stored (upper case); a .idx has a single tag named ""
+    vector<string> tagNames();
+
+    // Selects a tag by name, case-insensitively; false (with error set) if
+    // it is missing or can't be walked
+    bool selectTag(const string &name, string &error);
+
+    const string &keyExpression() {
+        return expression;
+    }
+
+    const string &forExpression() {
+        return filter;
+    }
+
+    unsigned int keyLength() {
+        return keylength;
+    }
+
+    // Position before the first key, or before the first key >= key
+    // (blank padded to the key length); next() then moves onto it
+    void first();
+    void seek(const string &key);
+    bool next();
+
+    // The key next() stopped on, without its trailing blanks; valid until
+    // the cursor leaves the leaf
+    dbfSlice key();
+    // Its record, 0 based as dbfReader::go() takes it
+    unsigned int record();
+
+private:
+    const char *node(uint32_t offset);
+    bool selectHeader(uint32_t offset, string &error);
+    void loadLeaf(uint32_t offset);
+    uint32_t descend(const string *target);
+};
+
+#endif /* CDXREADER_H */
@@ -28,6 +28,7 @@
 
 #include <iostream>
 #include <cstdio>
+#include <cstring>
 
 #include <stdlib.h>
 
@@ -43,6 +44,10 @@ using namespace std;
  * The actual number may be adjusted up or down as appropriate. */
 #define DBFBATCHTARGET 1024 * 1024 * 16
 
+/* Records per batch for column by column decoding, few enough that every
+ * column decoded from a batch stays in the L1/L2 cache while it is used. */
+#define DBFCOLUMNBATCH 1024
+
 /* Old versions of FoxPro (and probably other programs) store the memo file
  * record number in human-readable ASCII. Newer versions of FoxPro store it
  * as a 32-bit packed int. */
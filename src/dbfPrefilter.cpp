@@ -0,0 +1,127 @@
+/*
+ * File:   dbfPrefilter.cpp
+ */
+
+#include "dbfPrefilter.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PREFILTER_X86
+#endif
+
+typedef void (*drop_kernel)(const uint8_t *column, size_t rows, const uint8_t match[4], uint64_t *survivors);
+
+struct prefilter_dispatch {
+    drop_kernel drop;
+    const char *name;
+};
+
+void prefilterInit(uint64_t *survivors, size_t rows) {
+    size_t words = (rows + 63) / 64;
+
+    for (size_t w = 0; w < words; w++) {
+        survivors[w] = ~(uint64_t) 0;
+    }
+    if (rows % 64 != 0) {
+        survivors[words - 1] = ((uint64_t) 1 << (rows % 64)) - 1;
+    }
+}
+
+// Rows [first, rows), one at a time; the tail of the vector kernels
+static void dropRows(const uint8_t *column, size_t first, size_t rows, const uint8_t match[4], uint64_t *survivors) {
+    for (size_t i = first; i < rows; i++) {
+        uint8_t c = column[i];
+        uint64_t hit = (c == match[0]) | (c == match[1]) | (c == match[2]) | (c == match[3]);
+
+        survivors[i / 64] &= ~(hit << (i % 64));
+    }
+}
+
+static void dropScalar(const uint8_t *column, size_t rows, const uint8_t match[4], uint64_t *survivors) {
+    dropRows(column, 0, rows, match, survivors);
+}
+
+#ifdef PREFILTER_X86
+
+// A word of survivors (64 rows) per iteration, as 4 compares of 16 bytes
+__attribute__((target("sse2")))
+static void dropSSE2(const uint8_t *column, size_t rows, const uint8_t match[4], uint64_t *survivors) {
+    const __m128i m0 = _mm_set1_epi8((char) match[0]);
+    const __m128i m1 = _mm_set1_epi8((char) match[1]);
+    const __m128i m2 = _mm_set1_epi8((char) match[2]);
+    const __m128i m3 = _mm_set1_epi8((char) match[3]);
+    size_t i = 0;
+
+    for (; i + 64 <= rows; i += 64) {
+        uint64_t hits = 0;
+
+        for (int part = 0; part < 4; part++) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (column + i + part * 16));
+            __m128i eq = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, m0), _mm_cmpeq_epi8(v, m1)),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, m2), _mm_cmpeq_epi8(v, m3)));
+
+            hits |= (uint64_t) (uint16_t) _mm_movemask_epi8(eq) << (part * 16);
+        }
+        survivors[i / 64] &= ~hits;
+    }
+
+    dropRows(column, i, rows, match, survivors);
+}
+
+// The same as 2 compares of 32 bytes
+__attribute__((target("avx2")))
+static void dropAVX2(const uint8_t *column, size_t rows, const uint8_t match[4], uint64_t *survivors) {
+    const __m256i m0 = _mm256_set1_epi8((char) match[0]);
+    const __m256i m1 = _mm256_set1_epi8((char) match[1]);
+    const __m256i m2 = _mm256_set1_epi8((char) match[2]);
+    const __m256i m3 = _mm256_set1_epi8((char) match[3]);
+    size_t i = 0;
+
+    for (; i + 64 <= rows; i += 64) {
+        uint64_t hits = 0;
+
+        for (int part = 0; part < 2; part++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (column + i + part * 32));
+            __m256i eq = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, m0), _mm256_cmpeq_epi8(v, m1)),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, m2), _mm256_cmpeq_epi8(v, m3)));
+
+            hits |= (uint64_t) (uint32_t) _mm256_movemask_epi8(eq) << (part * 32);
+        }
+        survivors[i / 64] &= ~hits;
+    }
+
+    dropRows(column, i, rows, match, survivors);
+}
+
+#endif
+
+static prefilter_dispatch pickKernel() {
+    prefilter_dispatch picked = { dropScalar, "scalar" };
+
+#ifdef PREFILTER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        picked.drop = dropAVX2;
+        picked.name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        picked.drop = dropSSE2;
+        picked.name = "sse2";
+    }
+#endif
+
+    return picked;
+}
+
+static const prefilter_dispatch &dispatch() {
+    static const prefilter_dispatch picked = pickKernel();
+
+    return picked;
+}
+
+void prefilterDrop(const uint8_t *column, size_t rows, const uint8_t match[4], uint64_t *survivors) {
+    dispatch().drop(column, rows, match, survivors);
+}
+
+const char *prefilterKernel() {
+    return dispatch().name;
+}
@@ -0,0 +1,27 @@
+/*
+ * File:   dbfPrefilter.h
+ *
+ * Drops rows from a batch's survivor bitmap by testing a byte column (one
+ * byte per row, gathered from a fixed offset in each record) against up to
+ * four values, 16 or 32 rows per instruction.  The kernel is picked once, at
+ * run time: AVX2 where the CPU has it, SSE2 on any other x86, and a scalar
+ * loop elsewhere; they all give the same bitmap.
+ */
+
+#ifndef DBFPREFILTER_H
+#define DBFPREFILTER_H
+
+#include <cstddef>
+#include <stdint.h>
+
+// Bit i % 64 of survivors[i / 64] is row i: sets rows [0, rows), clears the
+// bits past them in the last word
+void prefilterInit(uint64_t *survivors, size_t rows);
+
+// Clears the bits of the rows whose byte is one of match[0..3]
+void prefilterDrop(const uint8_t *column, size_t rows, const uint8_t match[4], uint64_t *survivors);
+
+// The kernel in use: "avx2", "sse2" or "scalar"
+const char *prefilterKernel();
+
+#endif /* DBFPREFILTER_H */
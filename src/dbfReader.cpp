@@ -22,40 +22,71 @@
  * 
  * Created on July 26, 2016, 4:12 PM
  */
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <strings.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "dbf.h"
+#include "dbfPrefilter.h"
 #include "dbfReader.h"
 
 using namespace std;
 
 dbfReader::dbfReader() {
     is_open = false;
+    mapbase = NULL;
+    memobase = NULL;
+    memofailed = false;
 }
 
-dbfReader::dbfReader(string filename) {
-    open(filename);
+dbfReader::dbfReader(string filename, bool mapped) {
+    is_open = false;
+    mapbase = NULL;
+    memobase = NULL;
+    memofailed = false;
+    open(filename, mapped);
 }
 
 dbfReader::dbfReader(const dbfReader& orig) {
-
+    is_open = false;
+    mapbase = NULL;
+    memobase = NULL;
+    memofailed = false;
 }
 
+// A sync that fails or bails out after open() must not leak the mapping or
+// the stream and its buffer (every time, in watch mode)
 dbfReader::~dbfReader() {
-
+    if (is_open) {
+        close();
+    }
 }
 
-void dbfReader::open(string filename) {
-    size_t dbffieldsize;
+void dbfReader::open(string filename, bool mapped) {
+    if (mapped) {
+        openMapped(filename);
+    } else {
+        openStream(filename);
+    }
+    findMemoFile(filename);
 
-    int skipbytes; /* The length of the Visual FoxPro DBC in this file (if there is one) */
-    int fieldarraysize; /* The length of the field descriptor array */
-    size_t fieldnum; /* The current field being processed */
-    uint8_t terminator; /* Testing for terminator bytes */
+    is_open = true;
+
+    reset();
+}
+
+void dbfReader::openStream(string filename) {
+    size_t headerrestsize; /* Field descriptors, terminator and DBC after the fixed header */
+    char *headerrest;
 
     /* Get the DBF header */
     dbffile = fopen(filename.c_str(), "rb");
@@ -68,6 +99,95 @@ void dbfReader::open(string filename) {
     if (fread(&dbfheader, sizeof (dbfheader), 1, dbffile) != 1) {
         exitwitherror("Unable to read the entire DBF header", 1);
     }
+    if ((uint16_t) littleint16_t(dbfheader.headerlength) <= sizeof (dbfheader)) {
+        exitwitherror("Invalid DBF header length", 0);
+    }
+
+    try {
+        headerrestsize = (uint16_t) littleint16_t(dbfheader.headerlength) - sizeof (dbfheader);
+        headerrest = new char [headerrestsize];
+        if (fread(headerrest, headerrestsize, 1, dbffile) != 1) {
+            exitwitherror("Unable to read all of the field descriptions", 1);
+        }
+
+        parseFields(headerrest, headerrestsize);
+        delete[] headerrest;
+
+        dbfbatchsize = DBFBATCHTARGET / littleint16_t(dbfheader.recordlength);
+        if (!dbfbatchsize) {
+            dbfbatchsize = 1;
+        }
+
+        inputbuffer = new char [littleint16_t(dbfheader.recordlength) * dbfbatchsize];
+    } catch(std::bad_alloc& ba) {
+        exitwitherror(string("Unable to allocate memory from heap: ") + ba.what(), 1);
+    }
+
+    mapbase = NULL;
+}
+
+void dbfReader::openMapped(string filename) {
+    struct stat st;
+    int fd;
+    size_t headerlength;
+    size_t recordsavailable;
+
+    fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        exitwitherror("Unable to open the DBF file", 1);
+    }
+    if (fstat(fd, &st)) {
+        exitwitherror("Unable to stat the DBF file", 1);
+    }
+    if ((size_t) st.st_size < sizeof (dbfheader)) {
+        exitwitherror("Unable to read the entire DBF header", 0);
+    }
+
+    maplength = st.st_size;
+    mapbase = (char *) mmap(NULL, maplength, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapbase == MAP_FAILED) {
+        exitwitherror("Unable to map the DBF file", 1);
+    }
+    ::close(fd); /* The mapping keeps its own reference to the file */
+
+    /* The records are consumed front to back exactly once, so ask for
+     * aggressive readahead and, where the kernel supports it for file
+     * mappings, transparent huge pages to cut down on TLB misses. */
+    madvise(mapbase, maplength, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(mapbase, maplength, MADV_HUGEPAGE);
+#endif
+
+    memcpy(&dbfheader, mapbase, sizeof (dbfheader));
+    headerlength = (uint16_t) littleint16_t(dbfheader.headerlength);
+    if (headerlength <= sizeof (dbfheader) || headerlength > maplength) {
+        exitwitherror("Invalid DBF header length", 0);
+    }
+
+    try {
+        parseFields(mapbase + sizeof (dbfheader), headerlength - sizeof (dbfheader));
+    } catch(std::bad_alloc& ba) {
+        exitwitherror(string("Unable to allocate memory from heap: ") + ba.what(), 1);
+    }
+
+    recordsavailable = (maplength - headerlength) / littleint16_t(dbfheader.recordlength);
+    if (recordsavailable < littleint32_t(dbfheader.recordcount)) {
+        exitwitherror("Unable to read an entire record", 0);
+    }
+
+    /* The whole file is one batch that never needs refilling */
+    inputbuffer = mapbase + headerlength;
+    dbfbatchsize = littleint32_t(dbfheader.recordcount);
+    dbffile = NULL;
+}
+
+void dbfReader::parseFields(const char *fieldarray, size_t arraylength) {
+    size_t dbffieldsize;
+
+    int skipbytes; /* The length of the Visual FoxPro DBC in this file (if there is one) */
+    int fieldarraysize; /* The length of the field descriptor array */
+    size_t fieldnum; /* The current field being processed */
+    uint8_t terminator; /* Testing for terminator bytes */
 
     if (dbfheader.signature == 0x30) {
         /* Certain DBF files have an (empty?) 263-byte buffer after the header
@@ -80,7 +200,10 @@ void dbfReader::open(string filename) {
 
     /* Calculate the number of fields in this file */
     dbffieldsize = sizeof (DBFFIELD);
-    fieldarraysize = littleint16_t(dbfheader.headerlength) - sizeof (dbfheader) - skipbytes - 1;
+    fieldarraysize = arraylength - skipbytes - 1;
+    if (fieldarraysize < 0) {
+        exitwitherror("The field array size is negative", 0);
+    }
     if (fieldarraysize % dbffieldsize == 1) {
         /* Some dBASE III files include an extra terminator byte after the
          * field descriptor array.  If our calculations are one byte off,
@@ -93,64 +216,167 @@ void dbfReader::open(string filename) {
     }
     fieldcount = fieldarraysize / dbffieldsize;
 
-    
-    try {
-        /* Fetch the description of each field */
-        fields = new DBFFIELD [fieldcount];
-        
-        if (fread(fields, dbffieldsize, fieldcount, dbffile) != fieldcount) {
-            exitwitherror("Unable to read all of the field descriptions", 1);
-        }
+    /* Fetch the description of each field */
+    fields = new DBFFIELD [fieldcount];
+    memcpy(fields, fieldarray, fieldcount * dbffieldsize);
 
-        // Compute field starting positions
-        fieldpos = new int [fieldcount];
-        int tmp_pos = 1;
-        for (fieldnum = 0; fieldnum < fieldcount; fieldnum++) {
-            fieldpos[fieldnum] = tmp_pos;
-            tmp_pos += fields[fieldnum].length;
-        }
+    // Compute field starting positions
+    fieldpos = new int [fieldcount];
+    int tmp_pos = 1;
+    for (fieldnum = 0; fieldnum < fieldcount; fieldnum++) {
+        fieldpos[fieldnum] = tmp_pos;
+        tmp_pos += fields[fieldnum].length;
+    }
 
-        /* Check for the terminator character */
-        if (fread(&terminator, 1, 1, dbffile) != 1) {
-            exitwitherror("Unable to read the terminator byte", 1);
-        }
-        if (terminator != 13) {
-            exitwitherror("Invalid terminator byte", 0);
-        }
+    /* Check for the terminator character */
+    terminator = fieldarray[fieldarraysize];
+    if (terminator != 13) {
+        exitwitherror("Invalid terminator byte", 0);
+    }
 
-        /* Skip the database container if necessary */
-        if (fseek(dbffile, skipbytes, SEEK_CUR)) {
-            exitwitherror("Unable to seek in the DBF file", 1);
-        }
+    buildFieldHash();
+}
+
+/* Memo fields live in a file next to the DBF, named after it: a .fpt for
+ * FoxPro, a .dbt for dBASE.  It is only opened once a memo is read. */
+static bool isMemoType(char type) {
+    return type == 'M' || type == 'G' || type == 'P';
+}
+
+void dbfReader::findMemoFile(const string &filename) {
+    bool hasmemo = false;
+
+    memoname.clear();
+    memobase = NULL;
+    memofailed = false;
+    for (size_t fieldnum = 0; fieldnum < fieldcount; fieldnum++) {
+        hasmemo = hasmemo || isMemoType(fields[fieldnum].type);
+    }
+    if (!hasmemo) {
+        return;
+    }
+
+    /* dBASE III and IV with memo; everything else is FoxPro */
+    memodbt = (uint8_t) dbfheader.signature == 0x83 || (uint8_t) dbfheader.signature == 0x8B;
+
+    /* Same case as the DBF's extension first */
+    size_t dot = filename.rfind('.');
+    if (dot == string::npos || filename.find('/', dot) != string::npos) {
+        dot = filename.length();
+    }
+    bool upper = dot + 1 < filename.length() && isupper((unsigned char) filename[dot + 1]);
+    string base = filename.substr(0, dot);
+    string candidates[2] = {
+        base + (memodbt ? ".dbt" : ".fpt"),
+        base + (memodbt ? ".DBT" : ".FPT")
+    };
+    if (upper) {
+        candidates[0].swap(candidates[1]);
+    }
+
+    memoname = candidates[0];
+    if (access(memoname.c_str(), F_OK) != 0 && access(candidates[1].c_str(), F_OK) == 0) {
+        memoname = candidates[1];
+    }
+}
+
+/* false, once reported, if the memo file can't be used: its memos then read
+ * as malformed instead of ending the sync (or the daemon) */
+bool dbfReader::mapMemo() {
+    struct stat st;
+    string problem;
+    int fd;
+
+    if (memofailed) {
+        return false;
+    }
+
+    if (memoname.empty()) {
+        problem = "the DBF file has no memo file";
+    } else if ((fd = ::open(memoname.c_str(), O_RDONLY)) < 0) {
+        problem = string("unable to open it: ") + strerror(errno);
+    } else {
+        if (fstat(fd, &st)) {
+            problem = string("unable to stat it: ") + strerror(errno);
+        } else if ((size_t) st.st_size < sizeof (MEMOHEADER)) {
+            problem = "unable to read the entire memo header";
+        } else if (mapbase != NULL) {
+            memolength = st.st_size;
+            memobase = (char *) mmap(NULL, memolength, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (memobase == MAP_FAILED) {
+                memobase = NULL;
+                problem = string("unable to map it: ") + strerror(errno);
+            } else {
+                /* Memos are read wherever their records point, if at all */
+                madvise(memobase, memolength, MADV_RANDOM);
+            }
+        } else {
+            /* Read in stdio mode: a mapping raises SIGBUS if FoxPro shrinks
+             * the file under a running sync */
+            memolength = st.st_size;
+            memobase = new char[memolength];
+            for (size_t done = 0; done < memolength;) {
+                ssize_t got = pread(fd, memobase + done, memolength - done, done);
 
-        /* Make sure we're at the right spot before continuing */
-        if (ftell(dbffile) != littleint16_t(dbfheader.headerlength)) {
-            exitwitherror("At an unexpected offset in the DBF file", 0);
+                if (got <= 0) {
+                    delete[] memobase;
+                    memobase = NULL;
+                    problem = got < 0 ? string("unable to read it: ") + strerror(errno) : "it shrank while being read";
+                    break;
+                }
+                done += got;
+            }
         }
+        ::close(fd);
+    }
 
-        dbfbatchsize = DBFBATCHTARGET / littleint16_t(dbfheader.recordlength);
-        if (!dbfbatchsize) {
-            dbfbatchsize = 1;
+    if (memobase != NULL) {
+        if (!memodbt) {
+            memoblocksize = (uint16_t) sbigint16_t(((const MEMOHEADER *) memobase)->blocksize);
+        } else if ((uint8_t) dbfheader.signature == 0x8B) {
+            memoblocksize = (uint16_t) slittleint16_t(memobase + 20);
+        } else {
+            memoblocksize = 512; /* dBASE III */
+        }
+        if (memoblocksize == 0) {
+            releaseMemo();
+            problem = "invalid memo block size";
         }
-        
-        inputbuffer = new char [littleint16_t(dbfheader.recordlength) * dbfbatchsize];
-    } catch(std::bad_alloc& ba) {
-        exitwitherror(string("Unable to allocate memory from heap: ") + ba.what(), 1);
     }
-    
-    
-    is_open = true;
 
-    reset();
+    if (memobase == NULL) {
+        cerr << "Memo file " << memoname << " not used, its memos read as malformed: " << problem << endl;
+        memofailed = true;
+        return false;
+    }
+    return true;
+}
+
+void dbfReader::releaseMemo() {
+    if (memobase == NULL) {
+        return;
+    }
+    if (mapbase != NULL) {
+        munmap(memobase, memolength);
+    } else {
+        delete[] memobase;
+    }
+    memobase = NULL;
 }
 
 void dbfReader::close() {
-    delete[] inputbuffer;
+    releaseMemo();
+    if (mapbase != NULL) {
+        munmap(mapbase, maplength);
+        mapbase = NULL;
+    } else {
+        delete[] inputbuffer;
+        fclose(dbffile);
+    }
+    delete[] fieldhash;
     delete[] fieldpos;
     delete[] fields;
-    
-    fclose(dbffile);
-    
+
     is_open = false;
 }
 
@@ -159,15 +385,195 @@ void dbfReader::reset() {
         exitwitherror("DBF file is not loaded", 1);
     }
 
+    setRange(0, littleint32_t(dbfheader.recordcount));
+}
+
+void dbfReader::setRange(unsigned int first, unsigned int end) {
+    if (!is_open) {
+        exitwitherror("DBF file is not loaded", 1);
+    }
+
+    if (end > littleint32_t(dbfheader.recordcount)) {
+        end = littleint32_t(dbfheader.recordcount);
+    }
+    if (first > end) {
+        first = end;
+    }
+    recordend = end;
+
+    if (mapbase != NULL) {
+        /* The whole file is one batch, so just start inside it */
+        recordbase = 0;
+        batchindex = first - 1;
+        blocksread = dbfbatchsize;
+        return;
+    }
+
+    recordbase = first;
+    batchindex = -1;
+
+    /* Seek to the first record of the range */
+    if (fseek(dbffile, littleint16_t(dbfheader.headerlength) +
+            (long) first * (uint16_t) littleint16_t(dbfheader.recordlength), SEEK_SET)) {
+        exitwitherror("Unable to seek in the DBF file", 1);
+    }
+
     // First batch loading
     blocksread = fread(inputbuffer, littleint16_t(dbfheader.recordlength), dbfbatchsize, dbffile);
     if (blocksread != dbfbatchsize &&
-            recordbase + blocksread < littleint32_t(dbfheader.recordcount)) {
+            recordbase + blocksread < recordend) {
         exitwitherror("Unable to read an entire record", 1);
     }
+}
 
-    recordbase = 0;
-    batchindex = -1;
+bool dbfReader::go(unsigned int record) {
+    if (!is_open) {
+        exitwitherror("DBF file is not loaded", 1);
+    }
+
+    if (record >= littleint32_t(dbfheader.recordcount)) {
+        return false;
+    }
+
+    if (mapbase != NULL) {
+        setRange(record, record + 1);
+        return next();
+    }
+
+    /* Just the one record, without refilling the whole stdio buffer */
+    size_t recordlength = (uint16_t) littleint16_t(dbfheader.recordlength);
+    off_t offset = littleint16_t(dbfheader.headerlength) + (off_t) record * recordlength;
+    ssize_t got = pread(fileno(dbffile), inputbuffer, recordlength, offset);
+    if (got != (ssize_t) recordlength) {
+        throw runtime_error(got < 0 ? string("unable to read a record: ") + strerror(errno) : "the DBF file shrank while being read");
+    }
+
+    recordbase = record;
+    recordend = record + 1;
+    batchindex = 0;
+    blocksread = 1;
+    bufoffset = inputbuffer;
+    return true;
+}
+
+bool dbfReader::nextBatch(dbfBatch &batch) {
+    if (!next()) {
+        return false;
+    }
+
+    /* The rest of what is buffered (all of the range when mapped) */
+    size_t rows = min<size_t>(blocksread - batchindex, recordend - (recordbase + batchindex));
+    rows = min<size_t>(rows, DBFCOLUMNBATCH);
+
+    batch.records = bufoffset;
+    batch.rows = rows;
+    batch.recordlength = (uint16_t) littleint16_t(dbfheader.recordlength);
+
+    batchindex += rows - 1;
+    bufoffset = inputbuffer + batch.recordlength * batchindex;
+    return true;
+}
+
+void dbfReader::currentBatch(dbfBatch &batch) {
+    batch.records = bufoffset;
+    batch.rows = 1;
+    batch.recordlength = (uint16_t) littleint16_t(dbfheader.recordlength);
+}
+
+void dbfReader::useRow(const dbfBatch &batch, size_t row) {
+    bufoffset = (char *) batch.record(row);
+}
+
+/* The byte at offset of every record of a batch, made contiguous */
+static void gatherBytes(const dbfBatch &batch, unsigned int offset, vector<uint8_t> &bytes) {
+    const char *src = batch.records + offset;
+
+    bytes.resize(batch.rows);
+    for (size_t i = 0; i < batch.rows; i++) {
+        bytes[i] = src[i * batch.recordlength];
+    }
+}
+
+void dbfReader::getSurvivors(const dbfBatch &batch, const dbfBoundField *flags, size_t flagcount, vector<uint64_t> &survivors) {
+    static const uint8_t deleted[4] = { '*', '*', '*', '*' };
+    static const uint8_t truth[4] = { 'T', 'T', 'T', 'T' }; /* exactly "T", see the header */
+
+    survivors.resize((batch.rows + 63) / 64);
+    prefilterInit(survivors.data(), batch.rows);
+
+    gatherBytes(batch, 0, bytecolumn);
+    prefilterDrop(bytecolumn.data(), batch.rows, deleted, survivors.data());
+
+    for (size_t f = 0; f < flagcount; f++) {
+        gatherBytes(batch, flags[f].offset, bytecolumn);
+        prefilterDrop(bytecolumn.data(), batch.rows, truth, survivors.data());
+    }
+}
+
+void dbfReader::getBlank(const dbfBatch &batch, const dbfBoundField &field, const vector<uint32_t> &rows, vector<uint8_t> &blank) {
+    blank.resize(batch.rows);
+    for (size_t r = 0; r < rows.size(); r++) {
+        size_t i = rows[r];
+
+        blank[i] = trimSlice(batch.record(i) + field.offset, field.length).empty();
+    }
+}
+
+void dbfReader::getIntegers(const dbfBatch &batch, const dbfBoundField &field, const vector<uint32_t> &rows, dbfColumn<int64_t> &column) {
+    column.values.resize(batch.rows);
+    column.states.resize(batch.rows);
+    for (size_t r = 0; r < rows.size(); r++) {
+        size_t i = rows[r];
+
+        column.states[i] = decodeInteger(batch.record(i) + field.offset, field.type, field.length, field.decimals, column.values[i]);
+    }
+}
+
+void dbfReader::getDates(const dbfBatch &batch, const dbfBoundField &field, const vector<uint32_t> &rows, dbfColumn<int32_t> &column) {
+    column.values.resize(batch.rows);
+    column.states.resize(batch.rows);
+    for (size_t r = 0; r < rows.size(); r++) {
+        size_t i = rows[r];
+
+        column.states[i] = decodeDate(batch.record(i) + field.offset, field.length, column.values[i]);
+    }
+}
+
+void dbfReader::getFlags(const dbfBatch &batch, const dbfBoundField &field, const vector<uint32_t> &rows, vector<uint8_t> &set) {
+    set.resize(batch.rows);
+    for (size_t r = 0; r < rows.size(); r++) {
+        size_t i = rows[r];
+
+        set[i] = batch.record(i)[field.offset] == 'T';
+    }
+}
+
+void dbfReader::getLogicals(const dbfBatch &batch, const dbfBoundField &field, const vector<uint32_t> &rows, dbfColumn<uint8_t> &column) {
+    column.values.resize(batch.rows);
+    column.states.resize(batch.rows);
+    for (size_t r = 0; r < rows.size(); r++) {
+        size_t i = rows[r];
+        bool value = false;
+
+        column.states[i] = decodeLogical(batch.record(i) + field.offset, value);
+        column.values[i] = value;
+    }
+}
+
+unsigned int dbfReader::recordCount() {
+    return littleint32_t(dbfheader.recordcount);
+}
+
+int32_t dbfReader::lastUpdate() {
+    return (1900 + (uint8_t) dbfheader.year) * 10000 + (uint8_t) dbfheader.month * 100 + (uint8_t) dbfheader.day;
+}
+
+unsigned int dbfReader::headerLength() {
+    return littleint16_t(dbfheader.headerlength);
+}
+
+unsigned int dbfReader::recordLength() {
+    return littleint16_t(dbfheader.recordlength);
 }
 
 bool dbfReader::next() {
@@ -177,7 +583,7 @@ bool dbfReader::next() {
 
     batchindex++;
     // if already past last record, return false
-    if (recordbase + batchindex >= littleint32_t(dbfheader.recordcount)) {
+    if (recordbase + batchindex >= recordend) {
         return false;
     }
 
@@ -188,7 +594,7 @@ bool dbfReader::next() {
         batchindex = 0;
         recordbase += dbfbatchsize;
 
-        if (blocksread != dbfbatchsize && recordbase + blocksread < littleint32_t(dbfheader.recordcount)) {
+        if (blocksread != dbfbatchsize && recordbase + blocksread < recordend) {
             exitwitherror("Unable to read an entire record", 1);
         }
     }
@@ -206,68 +612,451 @@ string dbfReader::getString(unsigned int fieldnum) {
         exitwitherror("Field number out of bound", 1);
     }
 
+    if (isMemoType(fields[fieldnum].type)) {
+        return getSlice(fieldnum).str();
+    }
+
     int len = fields[fieldnum].length;
 
     return trimGet(bufoffset + fieldpos[fieldnum], len);
 }
 
+dbfSlice dbfReader::getSlice(unsigned int fieldnum) {
+    if (!is_open) {
+        exitwitherror("DBF file is not loaded", 1);
+    }
+
+    if (fieldnum >= fieldcount) {
+        exitwitherror("Field number out of bound", 1);
+    }
+
+    if (isMemoType(fields[fieldnum].type)) {
+        dbfSlice memo;
+
+        if (decodeMemo(bufoffset + fieldpos[fieldnum], fields[fieldnum].length, memo) != DBFVALUE_OK) {
+            memo.ptr = "";
+            memo.len = 0;
+        }
+        return trimSlice(memo.ptr, memo.len);
+    }
+
+    return trimSlice(bufoffset + fieldpos[fieldnum], fields[fieldnum].length);
+}
+
+const char *dbfReader::fieldStart(unsigned int fieldnum) {
+    if (!is_open) {
+        exitwitherror("DBF file is not loaded", 1);
+    }
+
+    if (fieldnum >= fieldcount) {
+        exitwitherror("Field number out of bound", 1);
+    }
+
+    return bufoffset + fieldpos[fieldnum];
+}
+
+char dbfReader::getFieldType(unsigned int fieldnum) {
+    if (fieldnum >= fieldcount) {
+        exitwitherror("Field number out of bound", 1);
+    }
+
+    return fields[fieldnum].type;
+}
+
+int dbfReader::getFieldDecimals(unsigned int fieldnum) {
+    if (fieldnum >= fieldcount) {
+        exitwitherror("Field number out of bound", 1);
+    }
+
+    return fields[fieldnum].decimals;
+}
+
+/* Digit parsing.  On little-endian hosts, runs of eight digits are checked
+ * and converted in a single 64-bit word (SWAR) instead of byte by byte. */
+
+#ifndef WORDS_BIGENDIAN
+static inline bool eightdigits(const char *p, uint64_t &value) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+
+    /* Every byte must be in '0'..'9': high nibble 3, and still 3 after +6 */
+    if (((v & 0xF0F0F0F0F0F0F0F0ULL) |
+            (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) != 0x3333333333333333ULL) {
+        return false;
+    }
+
+    v = ((v & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    v = ((v & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    value = ((v & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+
+    return true;
+}
+#endif
+
+/* Accumulate the digits starting at p into acc, returning the first
+ * non-digit position.  digits counts how many were consumed. */
+static const char *parsedigits(const char *p, const char *end, uint64_t &acc, int &digits) {
+#ifndef WORDS_BIGENDIAN
+    uint64_t chunk;
+
+    while (end - p >= 8 && eightdigits(p, chunk)) {
+        acc = acc * 100000000ULL + chunk;
+        digits += 8;
+        p += 8;
+    }
+#endif
+    while (p < end && *p >= '0' && *p <= '9') {
+        acc = acc * 10 + (*p - '0');
+        digits++;
+        p++;
+    }
+
+    return p;
+}
+
+static const int64_t powersoften[] = {
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL,
+    100000000LL, 1000000000LL, 10000000000LL, 100000000000LL,
+    1000000000000LL, 10000000000000LL, 100000000000000LL,
+    1000000000000000LL, 10000000000000000LL, 100000000000000000LL
+};
+
+dbfValueState dbfReader::getDecimal(unsigned int fieldnum, int64_t &value) {
+    const char *src = fieldStart(fieldnum);
+
+    return decodeDecimal(src, fields[fieldnum].type, fields[fieldnum].length, fields[fieldnum].decimals, value);
+}
+
+dbfValueState dbfReader::getInteger(unsigned int fieldnum, int64_t &value) {
+    const char *src = fieldStart(fieldnum);
+
+    return decodeInteger(src, fields[fieldnum].type, fields[fieldnum].length, fields[fieldnum].decimals, value);
+}
+
+dbfValueState dbfReader::getDate(unsigned int fieldnum, int32_t &value) {
+    const char *src = fieldStart(fieldnum);
+
+    if (fields[fieldnum].type != 'D') {
+        exitwitherror("Field is not a date", 0);
+    }
+
+    return decodeDate(src, fields[fieldnum].length, value);
+}
+
+dbfValueState dbfReader::getLogical(unsigned int fieldnum, bool &value) {
+    const char *src = fieldStart(fieldnum);
+
+    // Older prosheet layouts kept flags in one character C fields
+    if (fields[fieldnum].type != 'L' && !(fields[fieldnum].type == 'C' && fields[fieldnum].length == 1)) {
+        exitwitherror("Field is not logical", 0);
+    }
+
+    return decodeLogical(src, value);
+}
+
+dbfValueState dbfReader::getMemo(unsigned int fieldnum, dbfSlice &value) {
+    const char *src = fieldStart(fieldnum);
+
+    if (!isMemoType(fields[fieldnum].type)) {
+        exitwitherror("Field is not a memo", 0);
+    }
+
+    return decodeMemo(src, fields[fieldnum].length, value);
+}
+
+dbfValueState dbfReader::decodeDecimal(const char *src, char type, int length, int decimals, int64_t &value) {
+    if (type == 'I') {
+        value = slittleint32_t(src);
+        return DBFVALUE_OK;
+    }
+    if (type != 'N' && type != 'F') {
+        exitwitherror("Field is not numeric", 0);
+    }
+
+    dbfSlice slice = trimSlice(src, length);
+    if (slice.empty()) {
+        return DBFVALUE_BLANK;
+    }
+
+    const char *p = slice.ptr;
+    const char *end = slice.ptr + slice.len;
+    bool negative = false;
+
+    if (*p == '-' || *p == '+') {
+        negative = (*p == '-');
+        p++;
+    }
+
+    uint64_t acc = 0;
+    int intdigits = 0;
+    int fracdigits = 0;
+
+    p = parsedigits(p, end, acc, intdigits);
+    if (p < end && *p == '.') {
+        p = parsedigits(p + 1, end, acc, fracdigits);
+    }
+
+    /* Anything left over ("*****" overflow markers, stray text), no digits at
+     * all, more fraction than the field declares or more than int64 can hold */
+    if (p != end || intdigits + fracdigits == 0 || fracdigits > decimals ||
+            intdigits + decimals > 17) {
+        return DBFVALUE_BAD;
+    }
+
+    value = (int64_t) acc * powersoften[decimals - fracdigits];
+    if (negative) {
+        value = -value;
+    }
+
+    return DBFVALUE_OK;
+}
+
+dbfValueState dbfReader::decodeInteger(const char *src, char type, int length, int decimals, int64_t &value) {
+    dbfValueState state = decodeDecimal(src, type, length, decimals, value);
+
+    if (state == DBFVALUE_OK && type != 'I') {
+        value /= powersoften[decimals];
+    }
+
+    return state;
+}
+
+dbfValueState dbfReader::decodeDate(const char *src, int length, int32_t &value) {
+    dbfSlice slice = trimSlice(src, length);
+    if (slice.empty()) {
+        return DBFVALUE_BLANK;
+    }
+    if (slice.len != 8) {
+        return DBFVALUE_BAD;
+    }
+
+    uint64_t acc = 0;
+    int digits = 0;
+    if (parsedigits(slice.ptr, slice.ptr + 8, acc, digits) != slice.ptr + 8) {
+        return DBFVALUE_BAD;
+    }
+
+    int month = acc / 100 % 100;
+    int day = acc % 100;
+    if (month < 1 || month > 12 || day < 1 || day > 31) {
+        return DBFVALUE_BAD;
+    }
+
+    value = acc;
+    return DBFVALUE_OK;
+}
+
+dbfValueState dbfReader::decodeLogical(const char *src, bool &value) {
+    switch (src[0]) {
+        case 'T': case 't': case 'Y': case 'y':
+            value = true;
+            return DBFVALUE_OK;
+        case 'F': case 'f': case 'N': case 'n':
+            value = false;
+            return DBFVALUE_OK;
+        case ' ': case '?': case 0:
+            return DBFVALUE_BLANK;
+        default:
+            return DBFVALUE_BAD;
+    }
+}
+
+/* The field holds the memo's block number, as a 32-bit int in Visual
+ * FoxPro and as ASCII digits before it.  An .fpt block starts with its
+ * type and length (big-endian), a dBASE IV .dbt block with FF FF 08 00
+ * and the length including those 8 bytes; a dBASE III memo just runs to
+ * the next 0x1A. */
+dbfValueState dbfReader::decodeMemo(const char *src, int length, dbfSlice &value) {
+    int memostyle = length == 4 ? PACKEDMEMOSTYLE : NUMERICMEMOSTYLE;
+    uint64_t block = 0;
+
+    value.ptr = "";
+    value.len = 0;
+
+    if (memostyle == PACKEDMEMOSTYLE) {
+        block = (uint32_t) slittleint32_t(src);
+    } else {
+        dbfSlice digits = trimSlice(src, length);
+        int count = 0;
+
+        if (!digits.empty() && parsedigits(digits.ptr, digits.ptr + digits.len, block, count) != digits.ptr + digits.len) {
+            return DBFVALUE_BAD;
+        }
+    }
+    if (block == 0) {
+        return DBFVALUE_BLANK;
+    }
+
+    if (memobase == NULL && !mapMemo()) {
+        return DBFVALUE_BAD;
+    }
+
+    uint64_t offset = block * memoblocksize;
+    if (offset >= memolength) {
+        return DBFVALUE_BAD;
+    }
+
+    const char *start = memobase + offset;
+    size_t available = memolength - offset;
+
+    if (!memodbt) {
+        if (available < 8) {
+            return DBFVALUE_BAD;
+        }
+        uint32_t memolen = sbigint32_t(start + 4);
+        if (memolen > available - 8) {
+            return DBFVALUE_BAD;
+        }
+        value.ptr = start + 8;
+        value.len = memolen;
+    } else if (available >= 8 && memcmp(start, "\xFF\xFF\x08\x00", 4) == 0) {
+        uint32_t memolen = slittleint32_t(start + 4);
+        if (memolen < 8 || memolen > available) {
+            return DBFVALUE_BAD;
+        }
+        value.ptr = start + 8;
+        value.len = memolen - 8;
+    } else {
+        const char *end = (const char *) memchr(start, 0x1A, available);
+
+        value.ptr = start;
+        value.len = end != NULL ? end - start : available;
+    }
+
+    return value.len > 0 ? DBFVALUE_OK : DBFVALUE_BLANK;
+}
+
+dbfSlice dbfReader::getRecord() {
+    dbfSlice record = { bufoffset, (uint16_t) littleint16_t(dbfheader.recordlength) };
+    return record;
+}
+
 bool dbfReader::isClosedRow() {
     return bufoffset[0] == '*';
 }
 
 int dbfReader::getFieldIndex(string fieldname) {
-    int index = -1;
-    string tmp;
-    
-    for (int i=0 ; i<fieldcount ; i++) {
-        tmp = trimGet(fields[i].name, strlen(fields[i].name));
-
-        if (strequali(tmp, fieldname)) {
-            index = i;
-            break;
+    return findField(fieldname.data(), fieldname.length());
+}
+
+bool dbfReader::bind(const dbfFieldSpec *specs, size_t count, dbfBoundField *bound, string &error) {
+    ostringstream problems;
+
+    for (size_t i = 0; i < count; i++) {
+        const dbfFieldSpec &spec = specs[i];
+        int index = findField(spec.name, strlen(spec.name));
+
+        if (index < 0) {
+            problems << " missing field " << spec.name << endl;
+            continue;
+        }
+
+        const DBFFIELD &field = fields[index];
+        if (spec.types != NULL && (strchr(spec.types, field.type) == NULL || field.type == 0)) {
+            problems << " " << spec.name << " is of type " << field.type << ", expected one of " << spec.types << endl;
+        }
+        if (spec.maxlength > 0 && field.length > spec.maxlength) {
+            problems << " " << spec.name << " is " << (int) field.length << " wide, at most " << spec.maxlength << " expected" << endl;
         }
+        if (spec.decimals >= 0 && (field.type == 'N' || field.type == 'F') && field.decimals != spec.decimals) {
+            problems << " " << spec.name << " has " << (int) field.decimals << " decimals, " << spec.decimals << " expected" << endl;
+        }
+
+        bound[i].index = index;
+        bound[i].offset = fieldpos[index];
+        bound[i].length = field.length;
+        bound[i].decimals = field.decimals;
+        bound[i].type = field.type;
     }
-    
-    return index;
+
+    error = problems.str();
+    return error.empty();
 }
 
-bool dbfReader::strequali(string str1, string str2) {
-    if(str1.length() != str2.length()) {
-        return false;
+/* FNV-1a over the case-folded name, stopping at a NUL or trailing blanks */
+static uint32_t fieldnamehash(const char *name, size_t len, size_t &foldedlen) {
+    uint32_t hash = 2166136261U;
+
+    len = strnlen(name, len);
+    while (len > 0 && isspace((unsigned char) name[len - 1])) {
+        len--;
     }
-    
-    for(int i=0 ; i < str1.length() ; i++) {
-        if (tolower(str1[i]) != tolower(str2[i])) {
-            return false;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) tolower((unsigned char) name[i]);
+        hash *= 16777619U;
+    }
+
+    foldedlen = len;
+    return hash;
+}
+
+void dbfReader::buildFieldHash() {
+    size_t tablesize = 8;
+    size_t namelen;
+
+    while (tablesize < fieldcount * 2) {
+        tablesize <<= 1;
+    }
+
+    fieldhash = new int [tablesize];
+    fieldhashmask = tablesize - 1;
+    for (size_t i = 0; i < tablesize; i++) {
+        fieldhash[i] = -1;
+    }
+
+    for (size_t fieldnum = 0; fieldnum < fieldcount; fieldnum++) {
+        size_t slot = fieldnamehash(fields[fieldnum].name, XBASEFIELDNAMESIZE, namelen) & fieldhashmask;
+
+        while (fieldhash[slot] >= 0) {
+            slot = (slot + 1) & fieldhashmask;
         }
+        fieldhash[slot] = fieldnum;
     }
-    
-    return true;
 }
 
-string dbfReader::trimGet(char* src, int len) {
-    char temp[256];
+int dbfReader::findField(const char *name, size_t len) {
+    size_t namelen;
+    size_t fieldnamelen;
+    size_t slot = fieldnamehash(name, len, namelen) & fieldhashmask;
+
+    // Duplicate names resolve to the first field, as the linear scan did
+    for (; fieldhash[slot] >= 0; slot = (slot + 1) & fieldhashmask) {
+        const char *fieldname = fields[fieldhash[slot]].name;
 
-    // Visual FoxPro non-memo field limit is 254 chars
-    if (len > 254) {
-        len = 254;
+        fieldnamehash(fieldname, XBASEFIELDNAMESIZE, fieldnamelen);
+        if (fieldnamelen == namelen && strncasecmp(fieldname, name, namelen) == 0) {
+            return fieldhash[slot];
+        }
     }
 
+    return -1;
+}
+
+string dbfReader::trimGet(char* src, int len) {
+    // No cap at Visual FoxPro's 254 chars: longer text comes from memos or
+    // other writers' wide fields, and is returned whole
+    return trimSlice(src, len).str();
+}
+
+dbfSlice dbfReader::trimSlice(const char* src, int len) {
+    dbfSlice slice;
+
+    // Values stop at an embedded NUL, as some writers pad with them
+    len = strnlen(src, len);
+
     int i = 0;
-    while (i < len && isspace(src[i])) {
+    while (i < len && isspace((unsigned char) src[i])) {
         i++;
     }
 
     int j = len - 1;
-    while (j > i && isspace(src[j])) {
+    while (j > i && isspace((unsigned char) src[j])) {
         j--;
     }
 
-    strncpy(temp, src + i, j - i + 1);
-    temp[j -i + 1] = 0;
+    slice.ptr = src + i;
+    slice.len = j - i + 1;
 
-    if(j - i + 1 == 0)
-        return "";
-    else
-        return string(temp);
+    return slice;
 }
@@ -28,11 +28,113 @@
 
 #include <cstdlib>
 #include <string>
+#include <vector>
+#include <stdint.h>
 
 #include "dbf.h"
 
 using namespace std;
 
+/* A non-owning, already trimmed view of a field in the current record.
+ * It points straight into the record buffer (or the mapping), so it is only
+ * valid until the next call to next(), reset() or close(). */
+struct dbfSlice {
+    const char *ptr;
+    size_t len;
+
+    bool empty() const {
+        return len == 0;
+    }
+
+    bool equals(const char *str) const {
+        return strncmp(ptr, str, len) == 0 && str[len] == 0;
+    }
+
+    bool equals(const dbfSlice &other) const {
+        return len == other.len && memcmp(ptr, other.ptr, len) == 0;
+    }
+
+    string str() const {
+        return string(ptr, len);
+    }
+
+    void assignTo(string &dst) const {
+        dst.assign(ptr, len);
+    }
+
+    void appendTo(string &dst) const {
+        dst.append(ptr, len);
+    }
+};
+
+inline dbfSlice stringSlice(const string &str) {
+    dbfSlice slice = { str.data(), str.length() };
+    return slice;
+}
+
+inline bool operator==(const dbfSlice &slice, const char *str) {
+    return slice.equals(str);
+}
+
+inline bool operator!=(const dbfSlice &slice, const char *str) {
+    return !slice.equals(str);
+}
+
+inline ostream &operator<<(ostream &os, const dbfSlice &slice) {
+    return os.write(slice.ptr, slice.len);
+}
+
+/* Outcome of a typed field read.  BLANK is an empty (all blank) value, BAD
+ * is a value that doesn't parse as its declared type; neither stops the scan,
+ * so callers can report and skip the row. */
+enum dbfValueState {
+    DBFVALUE_OK,
+    DBFVALUE_BLANK,
+    DBFVALUE_BAD
+};
+
+/* A run of consecutive records from dbfReader::nextBatch(), to be decoded
+ * column by column.  The records are left where the reader has them, so a
+ * batch is only valid until the reader moves on. */
+struct dbfBatch {
+    const char *records;
+    size_t rows;
+    size_t recordlength;
+
+    const char *record(size_t row) const {
+        return records + row * recordlength;
+    }
+};
+
+/* One field of every row of a batch, decoded: values[i] is only meaningful
+ * where states[i] is DBFVALUE_OK. */
+template <typename T>
+struct dbfColumn {
+    vector<T> values;
+    vector<uint8_t> states;
+};
+
+/* A field the caller expects the DBF to have, declared once up front.
+ * types lists the acceptable DBFFIELD::type codes ("NF", "L", ..., NULL for any),
+ * maxlength is the widest value the caller can store (0 for any) and
+ * decimals the expected scale of N/F fields (-1 for any). */
+struct dbfFieldSpec {
+    const char *name;
+    const char *types;
+    int maxlength;
+    int decimals;
+};
+
+/* A field spec resolved against the open file by bind().  Reads through it
+ * are a constant offset into the record with no lookup or bounds check. */
+struct dbfBoundField {
+    unsigned int index;
+    unsigned int offset;
+    int length;
+    int decimals;
+    char type;
+};
+
 class dbfReader {
 private:
     FILE *dbffile;
@@ -44,37 +146,161 @@ private:
     unsigned int recordbase; /* The first record in a batch of records */
     unsigned int dbfbatchsize; /* How many DBF records to read at once */
     unsigned int batchindex; /* The offset inside the current batch of DBF records */
+    unsigned int recordend; /* next() stops before this record */
 
     int *fieldpos; /* Field starting positions in a record */
 
+    int *fieldhash; /* Open addressing table of field numbers, keyed by case-folded name */
+    size_t fieldhashmask;
+
     char *inputbuffer;
     char *bufoffset;
     size_t blocksread;
 
+    char *mapbase; /* Start of the read-only mapping in mapped mode, NULL otherwise */
+    size_t maplength;
+
+    string memoname; /* The .fpt/.dbt of a DBF with memo fields, "" if it has none */
+    char *memobase; /* The memo file, mapped in mapped mode and read in otherwise, NULL until a memo is read */
+    size_t memolength;
+    size_t memoblocksize;
+    bool memodbt; /* dBASE .dbt rather than FoxPro .fpt */
+    bool memofailed; /* The memo file couldn't be mapped, and that was reported */
+
+    vector<uint8_t> bytecolumn; /* One byte of each row of a batch, for the prefilter */
+
     bool is_open;
 
 public:
     dbfReader();
-    dbfReader(string filename);
+    dbfReader(string filename, bool mapped = false);
     dbfReader(const dbfReader& orig);
     virtual ~dbfReader();
 
-    void open(string filename);
+    // mapped = true maps the whole file read-only instead of copying record
+    // batches through stdio; records are then served straight from the mapping.
+    void open(string filename, bool mapped = false);
     void close();
 
     void reset();
     bool next();
 
+    // Limit next() to records [first, end), e.g. one chunk of a parallel scan
+    void setRange(unsigned int first, unsigned int end);
+    // Make record the current one, e.g. one an index pointed at; next() then
+    // returns false until reset() or setRange().  false if there is no such record;
+    // throws runtime_error if it can't be read, e.g. the file shrank under a sync
+    bool go(unsigned int record);
+
+    // Batches: up to DBFCOLUMNBATCH records from where next() would go on,
+    // all of them already in memory; next() then continues after them.
+    // false at the end of the range
+    bool nextBatch(dbfBatch &batch);
+    // The current record as a batch of one
+    void currentBatch(dbfBatch &batch);
+    // Point the getters at a row of a batch, without moving next()
+    void useRow(const dbfBatch &batch, size_t row);
+    unsigned int recordCount();
+
+    // Header facts that change whenever the file's layout or contents do:
+    // the last update date packed as yyyymmdd, the header and record lengths
+    int32_t lastUpdate();
+    unsigned int headerLength();
+    unsigned int recordLength();
+
+    // The raw bytes of the current record, deletion flag included
+    dbfSlice getRecord();
+
+    // Resolve and validate the given fields in one go.  On failure every
+    // mismatch is described in error and false is returned.
+    bool bind(const dbfFieldSpec *specs, size_t count, dbfBoundField *bound, string &error);
+
     // string getString(string field);
     string getString(unsigned int fieldnum);
+    dbfSlice getSlice(unsigned int fieldnum);
+
+    dbfSlice getSlice(const dbfBoundField &field) {
+        return trimSlice(bufoffset + field.offset, field.length);
+    }
+
+    // Typed getters, parsed straight from the record bytes
+    // N/F: fixed point scaled by 10^decimals ("12.50" in N(10,2) -> 1250), I: as is
+    dbfValueState getDecimal(unsigned int fieldnum, int64_t &value);
+    // N/F/I: integer part, truncated toward zero
+    dbfValueState getInteger(unsigned int fieldnum, int64_t &value);
+    // D: packed as yyyymmdd (20161231)
+    dbfValueState getDate(unsigned int fieldnum, int32_t &value);
+    // L (or C(1)): T/Y or F/N, '?' or blank for unknown
+    dbfValueState getLogical(unsigned int fieldnum, bool &value);
+
+    // The same, through bound fields
+    dbfValueState getDecimal(const dbfBoundField &field, int64_t &value) {
+        return decodeDecimal(bufoffset + field.offset, field.type, field.length, field.decimals, value);
+    }
+    dbfValueState getInteger(const dbfBoundField &field, int64_t &value) {
+        return decodeInteger(bufoffset + field.offset, field.type, field.length, field.decimals, value);
+    }
+    dbfValueState getDate(const dbfBoundField &field, int32_t &value) {
+        return decodeDate(bufoffset + field.offset, field.length, value);
+    }
+    dbfValueState getLogical(const dbfBoundField &field, bool &value) {
+        return decodeLogical(bufoffset + field.offset, value);
+    }
+
+    // M/G/P: the memo the field points at, served from the memo file, which
+    // is only mapped (or, reading through stdio, read) once a memo is read.  The slice is the memo
+    // as stored (not trimmed) and stays valid until close().  BLANK for no
+    // memo, BAD for a pointer outside the memo file.  getString() and
+    // getSlice(fieldnum) give memo fields' text, trimmed, the same way.
+    dbfValueState getMemo(unsigned int fieldnum, dbfSlice &value);
+    dbfValueState getMemo(const dbfBoundField &field, dbfSlice &value) {
+        return decodeMemo(bufoffset + field.offset, field.length, value);
+    }
+
+    // Prefilter: a bitmap of the rows of a batch (bit i % 64 of word i / 64)
+    // that are not deleted and have none of the given flags set.  A flag is
+    // set when its first byte is exactly 'T' (not the t/Y/y decodeLogical()
+    // also takes), as ordersync has always tested prosheet.DBF's flags, so
+    // this is a SIMD compare over bytes gathered from the records
+    void getSurvivors(const dbfBatch &batch, const dbfBoundField *flags, size_t flagcount, vector<uint64_t> &survivors);
+
+    // Columnar projection: one field of the given rows of a batch, in a
+    // tight loop over the records, into arrays indexed by row (those of the
+    // rows left out are left as they were)
+    void getBlank(const dbfBatch &batch, const dbfBoundField &field, const vector<uint32_t> &rows, vector<uint8_t> &blank);
+    void getIntegers(const dbfBatch &batch, const dbfBoundField &field, const vector<uint32_t> &rows, dbfColumn<int64_t> &column);
+    void getDates(const dbfBatch &batch, const dbfBoundField &field, const vector<uint32_t> &rows, dbfColumn<int32_t> &column);
+    void getLogicals(const dbfBatch &batch, const dbfBoundField &field, const vector<uint32_t> &rows, dbfColumn<uint8_t> &column);
+    // Whether the flag is set, as for getSurvivors()
+    void getFlags(const dbfBatch &batch, const dbfBoundField &field, const vector<uint32_t> &rows, vector<uint8_t> &set);
+
+    char getFieldType(unsigned int fieldnum);
+    int getFieldDecimals(unsigned int fieldnum);
     // int getInt(string field);
     bool isClosedRow();
     
     int getFieldIndex(string fieldname);
 
 private:
-    bool strequali(string str1, string str2);
+    void openStream(string filename);
+    void openMapped(string filename);
+    void parseFields(const char *fieldarray, size_t arraylength);
+    void findMemoFile(const string &filename);
+    bool mapMemo();
+    void releaseMemo();
+
+    void buildFieldHash();
+    int findField(const char *name, size_t len);
+
     string trimGet(char* src, int len);
+    static dbfSlice trimSlice(const char* src, int len);
+    const char *fieldStart(unsigned int fieldnum);
+
+    static dbfValueState decodeDecimal(const char *src, char type, int length, int decimals, int64_t &value);
+    static dbfValueState decodeInteger(const char *src, char type, int length, int decimals, int64_t &value);
+    static dbfValueState decodeDate(const char *src, int length, int32_t &value);
+    static dbfValueState decodeLogical(const char *src, bool &value);
+    dbfValueState decodeMemo(const char *src, int length, dbfSlice &value);
 };
 
 #endif /* DBFREADER_H */
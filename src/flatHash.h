@@ -0,0 +1,306 @@
+/*
+ * File:   flatHash.h
+ *
+ * Flat open-addressing hash table keyed by a fixed number of byte strings
+ * (artcono/color/size, barcode_id, ...).  Key bytes live back to back in a
+ * single buffer, every slot keeps its full hash so probes rarely touch key
+ * bytes, and lookups take dbfSlices, so neither a hit nor a miss allocates
+ * or inserts anything.
+ */
+
+#ifndef FLATHASH_H
+#define FLATHASH_H
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "dbfReader.h"
+
+using namespace std;
+
+template <typename V, int N>
+class flatHash {
+private:
+    enum {
+        SLOT_EMPTY = 0,
+        SLOT_FULL,
+        SLOT_ERASED
+    };
+
+    struct entry {
+        uint64_t hash;
+        uint32_t keyoffset; /* Start of the key parts in keys */
+        uint16_t keylen[N];
+        uint8_t state;
+        V value;
+    };
+
+    vector<entry> slots;
+    string keys; /* All key parts, back to back */
+    size_t count; /* Live entries */
+    size_t used; /* Live and erased slots */
+    size_t mask;
+
+public:
+    class iterator {
+    private:
+        flatHash *table;
+        size_t slot;
+
+        void skip() {
+            while (slot < table->slots.size() && table->slots[slot].state != SLOT_FULL) {
+                slot++;
+            }
+        }
+
+    public:
+        iterator(flatHash *t, size_t s) : table(t), slot(s) {
+            skip();
+        }
+
+        iterator &operator++() {
+            slot++;
+            skip();
+            return *this;
+        }
+
+        bool operator!=(const iterator &other) const {
+            return slot != other.slot;
+        }
+
+        dbfSlice key(int part) const {
+            return table->keyPart(table->slots[slot], part);
+        }
+
+        V &value() const {
+            return table->slots[slot].value;
+        }
+    };
+
+    flatHash(size_t expected = 0) {
+        count = 0;
+        used = 0;
+        reserve(expected);
+    }
+
+    void reserve(size_t expected) {
+        size_t capacity = 16;
+
+        while (capacity < expected * 2) {
+            capacity <<= 1;
+        }
+        if (capacity > slots.size()) {
+            rehash(capacity);
+        }
+    }
+
+    void clear() {
+        vector<entry>().swap(slots);
+        string().swap(keys);
+        count = 0;
+        used = 0;
+        rehash(16);
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    iterator begin() {
+        return iterator(this, 0);
+    }
+
+    iterator end() {
+        return iterator(this, slots.size());
+    }
+
+    // Insert, or overwrite the value of an existing key
+    void set(const dbfSlice *key, const V &value) {
+        uint64_t hash = hashKey(key);
+        entry *e = probe(key, hash);
+
+        if (e != NULL) {
+            e->value = value;
+            return;
+        }
+
+        if ((used + 1) * 2 > slots.size()) {
+            rehash(slots.size() * 2);
+        }
+
+        size_t slot = hash & mask;
+        while (slots[slot].state == SLOT_FULL) {
+            slot = (slot + 1) & mask;
+        }
+
+        e = &slots[slot];
+        if (e->state == SLOT_EMPTY) {
+            used++;
+        }
+        e->hash = hash;
+        e->keyoffset = keys.size();
+        for (int p = 0; p < N; p++) {
+            e->keylen[p] = key[p].len;
+            keys.append(key[p].ptr, key[p].len);
+        }
+        e->state = SLOT_FULL;
+        e->value = value;
+        count++;
+    }
+
+    // The whole table as one image in native layout, for loadFrom() in the
+    // same build to copy back without rehashing; V has to be plain data
+    void appendTo(string &dst) const {
+        uint64_t header[5] = { sizeof (entry), slots.size(), keys.size(), count, used };
+
+        dst.append((const char *) header, sizeof (header));
+        dst.append((const char *) slots.data(), slots.size() * sizeof (entry));
+        dst.append(keys);
+    }
+
+    // Replaces the table with the image at src, moving src past it
+    // return: false if there is no whole image of this table type at src
+    bool loadFrom(const char *&src, const char *end) {
+        uint64_t header[5];
+
+        if ((size_t) (end - src) < sizeof (header)) {
+            return false;
+        }
+        memcpy(header, src, sizeof (header));
+
+        uint64_t capacity = header[1];
+        if (header[0] != sizeof (entry) || capacity < 16 || (capacity & (capacity - 1)) != 0 ||
+                header[3] > header[4] || header[4] * 2 > capacity ||
+                (size_t) (end - src) - sizeof (header) < capacity * sizeof (entry) + header[2]) {
+            return false;
+        }
+        src += sizeof (header);
+
+        vector<entry>(capacity).swap(slots);
+        memcpy(&slots[0], src, capacity * sizeof (entry));
+        src += capacity * sizeof (entry);
+        keys.assign(src, header[2]);
+        src += header[2];
+        count = header[3];
+        used = header[4];
+        mask = capacity - 1;
+
+        return true;
+    }
+
+    // NULL when the key is absent
+    V *find(const dbfSlice *key) {
+        entry *e = probe(key, hashKey(key));
+
+        return e != NULL ? &e->value : NULL;
+    }
+
+    bool erase(const dbfSlice *key) {
+        entry *e = probe(key, hashKey(key));
+
+        if (e == NULL) {
+            return false;
+        }
+
+        e->state = SLOT_ERASED;
+        e->value = V();
+        count--;
+        return true;
+    }
+
+    static uint64_t hashKey(const dbfSlice *key) {
+        uint64_t h = 0x9E3779B97F4A7C15ULL;
+
+        for (int p = 0; p < N; p++) {
+            const char *src = key[p].ptr;
+            size_t len = key[p].len;
+            uint64_t word;
+
+            h = (h ^ len) * 0xFF51AFD7ED558CCDULL;
+            for (; len >= 8; len -= 8, src += 8) {
+                memcpy(&word, src, 8);
+                h = (h ^ word) * 0xC4CEB9FE1A85EC53ULL;
+                h ^= h >> 29;
+            }
+            if (len > 0) {
+                word = 0;
+                memcpy(&word, src, len);
+                h = (h ^ word) * 0xC4CEB9FE1A85EC53ULL;
+                h ^= h >> 29;
+            }
+        }
+
+        /* Final avalanche, so the low bits used for the slot are well mixed */
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ULL;
+        h ^= h >> 33;
+
+        return h;
+    }
+
+private:
+    dbfSlice keyPart(const entry &e, int part) const {
+        dbfSlice slice;
+        size_t offset = e.keyoffset;
+
+        for (int p = 0; p < part; p++) {
+            offset += e.keylen[p];
+        }
+        slice.ptr = keys.data() + offset;
+        slice.len = e.keylen[part];
+
+        return slice;
+    }
+
+    entry *probe(const dbfSlice *key, uint64_t hash) {
+        for (size_t slot = hash & mask; slots[slot].state != SLOT_EMPTY; slot = (slot + 1) & mask) {
+            entry &e = slots[slot];
+
+            if (e.state == SLOT_FULL && e.hash == hash && keyEquals(e, key)) {
+                return &e;
+            }
+        }
+
+        return NULL;
+    }
+
+    bool keyEquals(const entry &e, const dbfSlice *key) const {
+        const char *stored = keys.data() + e.keyoffset;
+
+        for (int p = 0; p < N; p++) {
+            if (e.keylen[p] != key[p].len || memcmp(stored, key[p].ptr, key[p].len) != 0) {
+                return false;
+            }
+            stored += key[p].len;
+        }
+
+        return true;
+    }
+
+    void rehash(size_t capacity) {
+        vector<entry> old(capacity);
+
+        old.swap(slots);
+        mask = capacity - 1;
+        used = count;
+
+        /* Erased slots are dropped; the stored hashes spare rehashing keys */
+        for (size_t i = 0; i < old.size(); i++) {
+            if (old[i].state != SLOT_FULL) {
+                continue;
+            }
+
+            size_t slot = old[i].hash & mask;
+            while (slots[slot].state != SLOT_EMPTY) {
+                slot = (slot + 1) & mask;
+            }
+            slots[slot] = std::move(old[i]);
+        }
+    }
+};
+
+#endif /* FLATHASH_H */
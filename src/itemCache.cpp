@@ -0,0 +1,138 @@
+/*
+ * File:   itemCache.cpp
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "itemCache.h"
+
+// Leads every cache file; bump the digit when the layout changes (the
+// table images also carry their entry sizes, which catches most builds
+// that lay them out differently)
+#define ITEMCACHEMAGIC "ORDITEM1"
+#define ITEMCACHEMAGICSIZE 8
+
+#define ITEMCACHEDIGESTSIZE CryptoPP::SHA1::DIGESTSIZE
+
+void itemCache::clear() {
+    index.clear();
+    version.clear();
+}
+
+bool itemCache::load(const string &filename, const string &dbstring, const string &version, string &error) {
+    struct stat st;
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "no item cache at " + filename;
+        return false;
+    }
+    if (fstat(fd, &st)) {
+        ::close(fd);
+        error = "can't stat " + filename;
+        return false;
+    }
+
+    size_t length = st.st_size;
+    void *base = length > 0 ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        error = filename + " is not an item cache";
+        return false;
+    }
+
+    bool loaded = loadImage(filename, (const char *) base, length, dbstring, version, error);
+    munmap(base, length);
+
+    if (!loaded) {
+        clear();
+    }
+    return loaded;
+}
+
+// Checks the mapped file and copies the index out of it
+bool itemCache::loadImage(const string &filename, const char *base, size_t length, const string &dbstring, const string &version, string &error) {
+    unsigned char digest[ITEMCACHEDIGESTSIZE];
+    uint16_t versionlength;
+
+    if (length < ITEMCACHEMAGICSIZE + ITEMCACHEDIGESTSIZE + sizeof (uint16_t) + ITEMCACHEDIGESTSIZE ||
+            memcmp(base, ITEMCACHEMAGIC, ITEMCACHEMAGICSIZE) != 0) {
+        error = filename + " is not an item cache";
+        return false;
+    }
+
+    const char *body = base + length - ITEMCACHEDIGESTSIZE;
+    sha.CalculateDigest(digest, (const unsigned char *) base, body - base);
+    if (memcmp(digest, body, ITEMCACHEDIGESTSIZE) != 0) {
+        error = filename + " is corrupt";
+        return false;
+    }
+
+    const char *pos = base + ITEMCACHEMAGICSIZE;
+    sha.CalculateDigest(digest, (const unsigned char *) dbstring.data(), dbstring.length());
+    if (memcmp(pos, digest, ITEMCACHEDIGESTSIZE) != 0) {
+        error = "item cache belongs to another database";
+        return false;
+    }
+    pos += ITEMCACHEDIGESTSIZE;
+
+    memcpy(&versionlength, pos, sizeof (uint16_t));
+    pos += sizeof (uint16_t);
+    if ((size_t) (body - pos) < versionlength) {
+        error = filename + " is truncated";
+        return false;
+    }
+    if (version.compare(0, string::npos, pos, versionlength) != 0) {
+        error = "items changed since the item cache was built";
+        return false;
+    }
+    pos += versionlength;
+
+    if (!index.loadFrom(pos, body - pos)) {
+        error = filename + " doesn't hold an item index of this build";
+        return false;
+    }
+    this->version = version;
+
+    return true;
+}
+
+bool itemCache::save(const string &filename, const string &dbstring, string &error) {
+    string data(ITEMCACHEMAGIC);
+    unsigned char digest[ITEMCACHEDIGESTSIZE];
+    string tmpname = filename + ".tmp";
+    uint16_t versionlength = version.length();
+
+    sha.CalculateDigest(digest, (const unsigned char *) dbstring.data(), dbstring.length());
+    data.append((const char *) digest, ITEMCACHEDIGESTSIZE);
+    data.append((const char *) &versionlength, sizeof (uint16_t));
+    data.append(version);
+    index.appendTo(data);
+
+    sha.CalculateDigest(digest, (const unsigned char *) data.data(), data.length());
+    data.append((const char *) digest, ITEMCACHEDIGESTSIZE);
+
+    FILE *out = fopen(tmpname.c_str(), "wb");
+    if (out == NULL) {
+        error = "can't create " + tmpname;
+        return false;
+    }
+    bool written = fwrite(data.data(), 1, data.length(), out) == data.length();
+    if (fclose(out) != 0 || !written) {
+        remove(tmpname.c_str());
+        error = "can't write " + tmpname;
+        return false;
+    }
+    if (rename(tmpname.c_str(), filename.c_str()) != 0) {
+        remove(tmpname.c_str());
+        error = "can't replace " + filename;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,46 @@
+/*
+ * File:   itemCache.h
+ *
+ * The item index, kept across syncs: in memory for the next sync in watch
+ * mode, and in a cache file for the next run.  Either is only used while
+ * the item version of the database (a fingerprint of the sock tables, see
+ * item_version()) is the one it was built at.
+ *
+ * On disk it is a small header (the database it was built from and the
+ * version), the index as the flat images of its tables, and a SHA-1 of
+ * everything before it.  The file is mapped and the tables copied out
+ * whole, so loading neither hashes nor interns anything; a cache that fails
+ * to load for any reason only means the index is built from the database.
+ */
+
+#ifndef ITEMCACHE_H
+#define ITEMCACHE_H
+
+#include <string>
+#include <cryptopp/sha.h>
+
+#include "itemIndex.h"
+
+using namespace std;
+
+class itemCache {
+public:
+    itemIndex index;
+    string version; /* Item version the index was built at, "" when not built */
+
+    void clear();
+
+    // false (with the reason) if filename is missing, unreadable or corrupt,
+    // or holds the index of another database or version
+    bool load(const string &filename, const string &dbstring, const string &version, string &error);
+    // Written next to filename and renamed over it, so a crash never leaves half a cache
+    bool save(const string &filename, const string &dbstring, string &error);
+
+private:
+    CryptoPP::SHA1 sha;
+
+    bool loadImage(const string &filename, const char *base, size_t length, const string &dbstring, const string &version,
+            string &error);
+};
+
+#endif /* ITEMCACHE_H */
@@ -0,0 +1,190 @@
+/*
+ * File:   itemIndex.cpp
+ */
+
+#include "itemIndex.h"
+#include "textUtil.h"
+
+// End of a variant chain
+#define NOVARIANT 0xFFFFFFFFU
+
+// Lookups normalize into a buffer of this size on the stack; longer values
+// (wide fields or memos) take a heap buffer
+#define ITEMKEYMAX 256
+
+// The 3 normalized ids, as an item key
+static dbfSlice idKey(const uint32_t *ids) {
+    dbfSlice key = { (const char *) ids, 3 * sizeof (uint32_t) };
+    return key;
+}
+
+itemIndex::itemIndex() {
+    count = 0;
+}
+
+void itemIndex::clear() {
+    for (int column = 0; column < 3; column++) {
+        terms[column].clear();
+        normalized[column].clear();
+    }
+    items.clear();
+    vector<variant>().swap(variants);
+    count = 0;
+}
+
+// The ids of value in column, interning it (and its normalized form) if
+// it is new
+itemIndex::term itemIndex::intern(int column, const string &value) {
+    dbfSlice key[1] = { stringSlice(value) };
+    term *found = terms[column].find(key);
+
+    if (found != NULL) {
+        return *found;
+    }
+
+    string trimmed = trim(value);
+    dbfSlice trimmedKey[1] = { stringSlice(trimmed) };
+    uint32_t *normalizedId = normalized[column].find(trimmedKey);
+    term t;
+
+    if (normalizedId == NULL) {
+        uint32_t id = normalized[column].size();
+
+        normalized[column].set(trimmedKey, id);
+        t.normalized = id;
+    } else {
+        t.normalized = *normalizedId;
+    }
+    t.exact = terms[column].size();
+    terms[column].set(key, t);
+
+    return t;
+}
+
+void itemIndex::add(const string &artcono, const string &color, const string &size, int item) {
+    const string *values[3] = { &artcono, &color, &size };
+    uint32_t exact[3];
+    uint32_t norm[3];
+
+    for (int column = 0; column < 3; column++) {
+        term t = intern(column, *values[column]);
+
+        exact[column] = t.exact;
+        norm[column] = t.normalized;
+    }
+
+    dbfSlice key[1] = { idKey(norm) };
+    item_entry *entry = items.find(key);
+    if (entry == NULL) {
+        item_entry fresh = { item, NOVARIANT };
+
+        items.set(key, fresh);
+        entry = items.find(key);
+    }
+    entry->guess = item;
+
+    for (uint32_t v = entry->variants; v != NOVARIANT; v = variants[v].next) {
+        if (variants[v].exact[0] == exact[0] && variants[v].exact[1] == exact[1] && variants[v].exact[2] == exact[2]) {
+            variants[v].item = item;
+            return;
+        }
+    }
+
+    variant added = { { exact[0], exact[1], exact[2] }, item, entry->variants };
+    entry->variants = variants.size();
+    variants.push_back(added);
+    count++;
+}
+
+int itemIndex::find(const dbfSlice *key, item_match &match) {
+    uint32_t exact[3];
+    uint32_t norm[3];
+    bool known = true; /* All 3 strings are interned as they are */
+
+    match = ITEM_NONE;
+    for (int column = 0; column < 3; column++) {
+        term *t = terms[column].find(&key[column]);
+
+        if (t != NULL) {
+            exact[column] = t->exact;
+            norm[column] = t->normalized;
+            continue;
+        }
+
+        known = false;
+
+        char buffer[ITEMKEYMAX];
+        string spill;
+        char *dst = buffer;
+        if (key[column].len > ITEMKEYMAX) {
+            spill.resize(key[column].len);
+            dst = &spill[0];
+        }
+        dbfSlice trimmed[1] = { { dst, trimInto(key[column].ptr, key[column].len, dst) } };
+
+        uint32_t *id = normalized[column].find(trimmed);
+        if (id == NULL) {
+            return 0;
+        }
+        norm[column] = *id;
+    }
+
+    dbfSlice itemKey[1] = { idKey(norm) };
+    item_entry *entry = items.find(itemKey);
+    if (entry == NULL) {
+        return 0;
+    }
+
+    if (known) {
+        for (uint32_t v = entry->variants; v != NOVARIANT; v = variants[v].next) {
+            if (variants[v].exact[0] == exact[0] && variants[v].exact[1] == exact[1] && variants[v].exact[2] == exact[2]) {
+                match = ITEM_EXACT;
+                return variants[v].item;
+            }
+        }
+    }
+
+    match = ITEM_NORMALIZED;
+    return entry->guess;
+}
+
+void itemIndex::appendTo(string &dst) const {
+    uint64_t header[3] = { sizeof (variant), variants.size(), count };
+
+    for (int column = 0; column < 3; column++) {
+        terms[column].appendTo(dst);
+        normalized[column].appendTo(dst);
+    }
+    items.appendTo(dst);
+    dst.append((const char *) header, sizeof (header));
+    dst.append((const char *) variants.data(), variants.size() * sizeof (variant));
+}
+
+bool itemIndex::loadFrom(const char *src, size_t len) {
+    const char *end = src + len;
+    uint64_t header[3];
+
+    clear();
+    for (int column = 0; column < 3; column++) {
+        if (!terms[column].loadFrom(src, end) || !normalized[column].loadFrom(src, end)) {
+            clear();
+            return false;
+        }
+    }
+    if (!items.loadFrom(src, end) || (size_t) (end - src) < sizeof (header)) {
+        clear();
+        return false;
+    }
+    memcpy(header, src, sizeof (header));
+    src += sizeof (header);
+    if (header[0] != sizeof (variant) || (size_t) (end - src) != header[1] * sizeof (variant)) {
+        clear();
+        return false;
+    }
+
+    variants.resize(header[1]);
+    memcpy(variants.data(), src, header[1] * sizeof (variant));
+    count = header[2];
+
+    return true;
+}
@@ -0,0 +1,79 @@
+/*
+ * File:   itemIndex.h
+ *
+ * sock:item ids keyed by (artcono, color, size), matched exactly or, failing
+ * that, after trim() (parenthesized text and surrounding blanks dropped).
+ * Every distinct artcono, color and size is interned once into an exact id
+ * and the id of its normalized form, so a lookup whose strings are known
+ * doesn't normalize anything.  Items are keyed by their normalized ids, each
+ * with the exact variants under it, so one probe answers both the exact and
+ * the normalized match.  Lookups don't allocate.
+ */
+
+#ifndef ITEMINDEX_H
+#define ITEMINDEX_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "flatHash.h"
+
+using namespace std;
+
+enum item_match {
+    ITEM_NONE,
+    ITEM_EXACT,
+    ITEM_NORMALIZED
+};
+
+class itemIndex {
+private:
+    struct term {
+        uint32_t exact;
+        uint32_t normalized;
+    };
+
+    struct item_entry {
+        int guess; /* Last item added with this normalized key */
+        uint32_t variants; /* First exact variant, NOVARIANT if none */
+    };
+
+    struct variant {
+        uint32_t exact[3];
+        int item;
+        uint32_t next;
+    };
+
+    flatHash<term, 1> terms[3]; /* Strings as stored, per column */
+    flatHash<uint32_t, 1> normalized[3]; /* Normalized strings, per column */
+    flatHash<item_entry, 1> items; /* Keyed by the 3 normalized ids */
+    vector<variant> variants;
+    size_t count;
+
+public:
+    itemIndex();
+
+    void clear();
+
+    // Items added, exact keys counted once
+    size_t size() const {
+        return count;
+    }
+
+    // A later item with the same key replaces an earlier one, for the exact
+    // and for the normalized match alike
+    void add(const string &artcono, const string &color, const string &size, int item);
+
+    // The item of key (artcono, color, size), 0 if none
+    int find(const dbfSlice *key, item_match &match);
+
+    // The index as the images of its tables, for itemCache, and back
+    void appendTo(string &dst) const;
+    bool loadFrom(const char *src, size_t len);
+
+private:
+    term intern(int column, const string &value);
+};
+
+#endif /* ITEMINDEX_H */
@@ -0,0 +1,124 @@
+/*
+ * File:   order.h
+ *
+ * Rows of the production tables that ordersync reads and writes.
+ */
+
+#ifndef ORDER_H
+#define ORDER_H
+
+#include <string>
+#include <stdint.h>
+
+#include "stringPool.h"
+#include "textUtil.h"
+
+using namespace std;
+
+struct order_content {
+    /*
+        id serial NOT NULL,
+        date date NOT NULL,
+        customer character varying(64) NOT NULL,
+        orderno character varying(64) NOT NULL,
+        item_id integer NOT NULL,
+        quantity integer NOT NULL,
+        quota integer NOT NULL,
+        barcode_id character varying(8) NOT NULL,
+        exfdate date,
+     */
+    int id;
+    int32_t date; // yyyymmdd
+    uint32_t customer; // in the sync's stringPool
+    uint32_t orderno; // in the sync's stringPool
+    int item_id;
+    int quantity;
+    int quota;
+    string barcode_id; // at most 8 chars, short enough to stay inside the string
+    int32_t exfdate; // yyyymmdd, 0 for NULL
+};
+
+struct order {
+    /*
+        id integer NOT NULL DEFAULT nextval('"production:order_id_seq1"'::regclass),
+        name character varying(128) NOT NULL,
+        customer character varying(128) NOT NULL,
+        subclass character varying(128) NOT NULL,
+        date date NOT NULL,
+        order_group_id integer,
+     */
+    int id;
+    string name;
+    string customer;
+    // string subclass;
+    string date;
+};
+
+// Writable order_content columns, as bits of a change mask
+enum order_column {
+    OC_DATE,
+    OC_CUSTOMER,
+    OC_ORDERNO,
+    OC_ITEM_ID,
+    OC_QUANTITY,
+    OC_QUOTA,
+    OC_EXFDATE,
+    OC_COLUMNCOUNT
+};
+
+#define OC_BIT(column) (1U << (column))
+
+static const char *const order_column_names[OC_COLUMNCOUNT] = {
+    "date",
+    "customer",
+    "orderno",
+    "item_id",
+    "quantity",
+    "quota",
+    "exfdate"
+};
+
+// Mask of the columns in which two rows differ; rows with their text in the
+// same stringPool only take int compares
+inline unsigned int order_content_diff(const order_content &from, const order_content &to) {
+    unsigned int columns = 0;
+
+    if (from.date != to.date) columns |= OC_BIT(OC_DATE);
+    if (from.customer != to.customer) columns |= OC_BIT(OC_CUSTOMER);
+    if (from.orderno != to.orderno) columns |= OC_BIT(OC_ORDERNO);
+    if (from.item_id != to.item_id) columns |= OC_BIT(OC_ITEM_ID);
+    if (from.quantity != to.quantity) columns |= OC_BIT(OC_QUANTITY);
+    if (from.quota != to.quota) columns |= OC_BIT(OC_QUOTA);
+    if (from.exfdate != to.exfdate) columns |= OC_BIT(OC_EXFDATE);
+
+    return columns;
+}
+
+// A column's value as text, for reports and statements ("" for a NULL exfdate)
+inline string order_column_value(const stringPool &strings, const order_content &ord, int column) {
+    string date;
+
+    switch (column) {
+        case OC_DATE: isoDate(date, ord.date); return date;
+        case OC_CUSTOMER: return strings.str(ord.customer);
+        case OC_ORDERNO: return strings.str(ord.orderno);
+        case OC_ITEM_ID: return to_string(ord.item_id);
+        case OC_QUANTITY: return to_string(ord.quantity);
+        case OC_QUOTA: return to_string(ord.quota);
+        case OC_EXFDATE: isoDate(date, ord.exfdate); return date;
+    }
+    return "";
+}
+
+// Where a scan sets its rows aside for a reconciliation after it: the
+// merge-join's orderSorter, or the server join's orderStage
+class orderSink {
+public:
+    virtual ~orderSink() {
+    }
+
+    // keep: a malformed row, which only claims the DB row of its barcode_id
+    virtual void add(const order_content &ord, bool keep) = 0;
+};
+
+#endif /* ORDER_H */
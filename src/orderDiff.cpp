@@ -0,0 +1,75 @@
+/*
+ * File:   orderDiff.cpp
+ */
+
+#include <algorithm>
+
+#include "orderDiff.h"
+
+orderDiff::orderDiff(order_content_index &current) : current(current) {
+}
+
+orderDiff::~orderDiff() {
+}
+
+void orderDiff::diff(const order_content &ord, order_change &change) {
+    dbfSlice key[1] = { stringSlice(ord.barcode_id) };
+    order_content *found = current.find(key);
+
+    match(found, ord, change);
+    if (found != NULL) {
+        current.erase(key);
+    }
+}
+
+void orderDiff::keep(const string &barcode_id) {
+    dbfSlice key[1] = { stringSlice(barcode_id) };
+
+    current.erase(key);
+}
+
+static bool byBarcode(const order_change &a, const order_change &b) {
+    return a.before.barcode_id < b.before.barcode_id;
+}
+
+void orderDiff::leftovers(vector<order_change> &changes) {
+    size_t first = changes.size();
+
+    changes.reserve(first + current.size());
+    for (order_content_index::iterator itr = current.begin(); itr != current.end(); ++itr) {
+        order_change change;
+
+        removal(itr.value(), change);
+        itr.key(0).assignTo(change.before.barcode_id);
+        changes.push_back(change);
+    }
+
+    sort(changes.begin() + first, changes.end(), byBarcode);
+}
+
+void orderDiff::match(const order_content *found, const order_content &ord, order_change &change) {
+    if (found == NULL) {
+        change.op = CHANGE_INSERT;
+        change.id = 0;
+        change.columns = 0;
+        change.after = ord;
+        return;
+    }
+
+    change.columns = order_content_diff(*found, ord);
+    if (change.columns) {
+        change.op = CHANGE_UPDATE;
+        change.id = found->id;
+        change.before = *found;
+        change.after = ord;
+    } else {
+        change.op = CHANGE_NONE;
+    }
+}
+
+void orderDiff::removal(const order_content &row, order_change &change) {
+    change.op = CHANGE_DELETE;
+    change.id = row.id;
+    change.columns = 0;
+    change.before = row;
+}
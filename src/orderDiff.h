@@ -0,0 +1,66 @@
+/*
+ * File:   orderDiff.h
+ *
+ * Works out what a sync has to do to production:order_content without
+ * doing any of it.  Decoded prosheet rows go in one at a time and are
+ * matched by barcode_id against the rows loaded from the DB; each comes
+ * out as an insert, an update of exactly the differing columns, or
+ * nothing.  Once the scan is over, whatever was never matched comes out as
+ * deletes.  Reporting, serializing and applying the changes are left to
+ * the caller.
+ */
+
+#ifndef ORDERDIFF_H
+#define ORDERDIFF_H
+
+#include <string>
+#include <vector>
+
+#include "flatHash.h"
+#include "order.h"
+
+using namespace std;
+
+// order_content rows keyed by barcode_id
+typedef flatHash<order_content, 1> order_content_index;
+
+enum order_change_op {
+    CHANGE_NONE,
+    CHANGE_INSERT,
+    CHANGE_UPDATE,
+    CHANGE_DELETE
+};
+
+struct order_change {
+    order_change_op op;
+    int id; /* UPDATE, DELETE: the DB row */
+    unsigned int columns; /* UPDATE: mask of OC_BIT(order_column) that differ */
+    order_content before; /* UPDATE, DELETE: the DB row as loaded */
+    order_content after; /* INSERT, UPDATE: the prosheet row */
+};
+
+class orderDiff {
+private:
+    order_content_index &current; /* DB rows not matched yet */
+
+public:
+    orderDiff(order_content_index &current);
+    virtual ~orderDiff();
+
+    // The change ord calls for; the DB row it matched (if any) is used up
+    void diff(const order_content &ord, order_change &change);
+
+    // Leave the DB row of barcode_id as it is, e.g. for a malformed prosheet row
+    void keep(const string &barcode_id);
+
+    // Deletes for the DB rows no prosheet row matched, in barcode order
+    void leftovers(vector<order_change> &changes);
+
+    // The same decisions for one pair, for callers that match rows up
+    // themselves: ord against the DB row of its barcode (NULL if none), and
+    // the delete of a DB row nothing matched
+    static void match(const order_content *found, const order_content &ord, order_change &change);
+    static void removal(const order_content &row, order_change &change);
+};
+
+#endif /* ORDERDIFF_H */
@@ -0,0 +1,187 @@
+/*
+ * File:   orderSorter.cpp
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "orderSorter.h"
+
+static bool byBarcode(const sorted_row &a, const sorted_row &b) {
+    int order = a.ord.barcode_id.compare(b.ord.barcode_id);
+
+    return order < 0 || (order == 0 && a.seq < b.seq);
+}
+
+orderSorter::orderSorter(size_t memorylimit) {
+    this->memorylimit = memorylimit;
+    memoryused = 0;
+    seq = 0;
+    position = 0;
+}
+
+orderSorter::~orderSorter() {
+    for (size_t i = 0; i < runs.size(); i++) {
+        fclose(runs[i]);
+    }
+}
+
+void orderSorter::add(const order_content &ord, bool keep) {
+    sorted_row row;
+
+    row.seq = seq++;
+    row.keep = keep;
+    row.ord = ord;
+    rows.push_back(row);
+
+    memoryused += sizeof (sorted_row);
+    if (memoryused >= memorylimit) {
+        spill();
+    }
+}
+
+// Run records: seq, keep, the ints (the text columns as their stringPool
+// ids), then barcode_id prefixed by its uint16_t length; native byte order,
+// a run only lives as long as the sync and its pool
+
+template <typename T>
+static void put(string &dst, T value) {
+    dst.append((const char *) &value, sizeof (T));
+}
+
+static void putString(string &dst, const string &value) {
+    put(dst, (uint16_t) value.length());
+    dst += value;
+}
+
+template <typename T>
+static bool get(FILE *src, T &value) {
+    return fread(&value, sizeof (T), 1, src) == 1;
+}
+
+static bool getString(FILE *src, string &value) {
+    uint16_t len;
+
+    if (!get(src, len)) {
+        return false;
+    }
+    value.resize(len);
+    return len == 0 || fread(&value[0], 1, len, src) == len;
+}
+
+void orderSorter::spill() {
+    FILE *run = tmpfile();
+    string record;
+
+    if (run == NULL) {
+        throw runtime_error(string("can't create a sort run: ") + strerror(errno));
+    }
+    runs.push_back(run);
+
+    sort(rows.begin(), rows.end(), byBarcode);
+    for (size_t i = 0; i < rows.size(); i++) {
+        const sorted_row &row = rows[i];
+
+        record.clear();
+        put(record, row.seq);
+        put(record, (uint8_t) row.keep);
+        put(record, (int32_t) row.ord.date);
+        put(record, (uint32_t) row.ord.customer);
+        put(record, (uint32_t) row.ord.orderno);
+        put(record, (int32_t) row.ord.item_id);
+        put(record, (int32_t) row.ord.quantity);
+        put(record, (int32_t) row.ord.quota);
+        put(record, (int32_t) row.ord.exfdate);
+        putString(record, row.ord.barcode_id);
+        if (fwrite(record.data(), 1, record.length(), run) != record.length()) {
+            throw runtime_error(string("can't write a sort run: ") + strerror(errno));
+        }
+    }
+
+    rows.clear();
+    memoryused = 0;
+}
+
+bool orderSorter::readRow(FILE *run, sorted_row &row) {
+    uint8_t keep;
+    int32_t item_id;
+    int32_t quantity;
+    int32_t quota;
+
+    if (!get(run, row.seq)) {
+        return false;
+    }
+    if (!get(run, keep) || !get(run, row.ord.date) || !get(run, row.ord.customer) || !get(run, row.ord.orderno) ||
+            !get(run, item_id) || !get(run, quantity) || !get(run, quota) || !get(run, row.ord.exfdate) ||
+            !getString(run, row.ord.barcode_id)) {
+        throw runtime_error("sort run is truncated");
+    }
+    row.keep = keep != 0;
+    row.ord.id = 0;
+    row.ord.item_id = item_id;
+    row.ord.quantity = quantity;
+    row.ord.quota = quota;
+
+    return true;
+}
+
+// Heap order: the run whose head sorts last is at the bottom
+bool orderSorter::headAfter(size_t a, size_t b) const {
+    return byBarcode(heads[b], heads[a]);
+}
+
+void orderSorter::finish() {
+    if (runs.empty()) {
+        sort(rows.begin(), rows.end(), byBarcode);
+        position = 0;
+        return;
+    }
+
+    if (!rows.empty()) {
+        spill();
+    }
+    vector<sorted_row>().swap(rows);
+
+    heads.resize(runs.size());
+    heap.clear();
+    for (size_t i = 0; i < runs.size(); i++) {
+        rewind(runs[i]);
+        if (readRow(runs[i], heads[i])) {
+            heap.push_back(i);
+        }
+    }
+    make_heap(heap.begin(), heap.end(), [this](size_t a, size_t b) {
+        return headAfter(a, b);
+    });
+}
+
+bool orderSorter::next(sorted_row &row) {
+    if (runs.empty()) {
+        if (position == rows.size()) {
+            return false;
+        }
+        swap(row, rows[position++]);
+        return true;
+    }
+
+    if (heap.empty()) {
+        return false;
+    }
+
+    auto after = [this](size_t a, size_t b) {
+        return headAfter(a, b);
+    };
+    pop_heap(heap.begin(), heap.end(), after);
+    size_t run = heap.back();
+
+    swap(row, heads[run]);
+    if (readRow(runs[run], heads[run])) {
+        push_heap(heap.begin(), heap.end(), after);
+    } else {
+        heap.pop_back();
+    }
+
+    return true;
+}
@@ -0,0 +1,61 @@
+/*
+ * File:   orderSorter.h
+ *
+ * Sorts prosheet rows by barcode_id in bounded memory, for the merge-join
+ * sync.  Rows are kept in memory until they take up the memory limit, then
+ * sorted and spilled to a temporary file as a run; next() merges the runs
+ * (or just walks the one in memory if nothing was spilled).  Rows with the
+ * same barcode_id come out in the order they were added.
+ */
+
+#ifndef ORDERSORTER_H
+#define ORDERSORTER_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "order.h"
+
+using namespace std;
+
+struct sorted_row {
+    uint64_t seq; /* Order of add(), to break barcode_id ties */
+    bool keep; /* Malformed row: only claims the barcode_id's DB row */
+    order_content ord;
+};
+
+class orderSorter : public orderSink {
+private:
+    size_t memorylimit;
+    size_t memoryused; /* Estimated size of rows */
+    uint64_t seq;
+    vector<sorted_row> rows; /* Run being built, or the only run */
+    size_t position; /* Next of rows once finished, when nothing was spilled */
+
+    vector<FILE *> runs; /* Spilled runs, rewound once finished */
+    vector<sorted_row> heads; /* Next row of each run */
+    vector<size_t> heap; /* Runs that have rows left, smallest head first */
+
+public:
+    orderSorter(size_t memorylimit);
+    virtual ~orderSorter();
+
+    virtual void add(const order_content &ord, bool keep);
+
+    // No more add()s; the rows can be read back with next()
+    void finish();
+    bool next(sorted_row &row);
+
+    size_t runCount() const {
+        return runs.size();
+    }
+
+private:
+    void spill();
+    bool readRow(FILE *run, sorted_row &row);
+    bool headAfter(size_t a, size_t b) const;
+};
+
+#endif /* ORDERSORTER_H */
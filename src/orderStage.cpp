@@ -0,0 +1,65 @@
+/*
+ * File:   orderStage.cpp
+ */
+
+#include "orderStage.h"
+#include "textUtil.h"
+
+// Marks NULL in the rows COPYed to ordersync_rows
+#define STAGENULL "\\N"
+
+orderStage::orderStage(pqxx::work &txn, const stringPool &strings) : txn(txn), strings(strings), row(10) {
+    copy = NULL;
+    seq = 0;
+}
+
+orderStage::~orderStage() {
+    delete copy;
+}
+
+void orderStage::begin() {
+    txn.exec("CREATE TEMP TABLE ordersync_rows (seq integer NOT NULL, keep boolean NOT NULL, "
+            "date date, customer varchar(64), orderno varchar(64), item_id integer, quantity integer, "
+            "quota integer, barcode_id varchar(8) NOT NULL, exfdate date) ON COMMIT DROP");
+    copy = new pqxx::tablewriter(txn, "ordersync_rows", STAGENULL);
+    seq = 0;
+}
+
+void orderStage::add(const order_content &ord, bool keep) {
+    row[0] = to_string(seq++);
+    row[1] = keep ? "t" : "f";
+    row[8] = ord.barcode_id;
+    if (keep) {
+        // Only the barcode_id of a malformed row is known
+        for (int f = 2; f < 8; f++) {
+            row[f] = STAGENULL;
+        }
+        row[9] = STAGENULL;
+    } else {
+        if (ord.date == 0) {
+            row[2] = STAGENULL;
+        } else {
+            isoDate(row[2], ord.date);
+        }
+        row[3] = strings.str(ord.customer);
+        row[4] = strings.str(ord.orderno);
+        row[5] = to_string(ord.item_id);
+        row[6] = to_string(ord.quantity);
+        row[7] = to_string(ord.quota);
+        if (ord.exfdate == 0) {
+            row[9] = STAGENULL;
+        } else {
+            isoDate(row[9], ord.exfdate);
+        }
+    }
+
+    *copy << row;
+}
+
+void orderStage::finish() {
+    copy->complete();
+    delete copy;
+    copy = NULL;
+
+    txn.exec("ANALYZE ordersync_rows");
+}
@@ -0,0 +1,48 @@
+/*
+ * File:   orderStage.h
+ *
+ * Streams prosheet rows into ordersync_rows, a temporary (so unlogged)
+ * staging table, through one COPY that stays open for the whole scan, for
+ * the server join.  Rows are numbered in the order they are added; once
+ * finished the table is analyzed, as temporary tables never are otherwise.
+ *
+ * Nothing else can run in the transaction between begin() and finish().
+ */
+
+#ifndef ORDERSTAGE_H
+#define ORDERSTAGE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pqxx/pqxx>
+
+#include "order.h"
+#include "stringPool.h"
+
+using namespace std;
+
+class orderStage : public orderSink {
+private:
+    pqxx::work &txn;
+    const stringPool &strings;
+    pqxx::tablewriter *copy; /* Open between begin() and finish() */
+    vector<string> row;
+    uint64_t seq;
+
+public:
+    orderStage(pqxx::work &txn, const stringPool &strings);
+    virtual ~orderStage();
+
+    // Creates ordersync_rows and starts the COPY
+    void begin();
+    virtual void add(const order_content &ord, bool keep);
+    // Completes the COPY
+    void finish();
+
+    uint64_t size() const {
+        return seq;
+    }
+};
+
+#endif /* ORDERSTAGE_H */
@@ -0,0 +1,305 @@
+/*
+ * File:   orderWriter.cpp
+ */
+
+#include <sstream>
+#include <stdexcept>
+
+#include "orderWriter.h"
+
+// Marks NULL in the rows COPYed to the staging table
+#define STAGENULL "\\N"
+
+// Pipelined queries allowed in flight before the scan waits for results
+#define PIPELINEWINDOW 1024
+
+orderWriter::orderWriter(pqxx::connection_base &c, pqxx::work &txn, const stringPool &strings, size_t batchsize, bool pipelined, syncMetrics *metrics) :
+        conn(c), txn(txn), strings(strings), preparedmasks(1 << OC_COLUMNCOUNT, false) {
+    this->batchsize = batchsize;
+    this->metrics = metrics;
+    this->pipelined = pipelined && batchsize == 0;
+    staged = false;
+    pipe = NULL;
+    notrun = 0;
+
+    c.prepare("add", "INSERT INTO \"production:order_content\" (date, customer, orderno, item_id, quantity, quota, barcode_id, exfdate) VALUES ($1, $2, $3, $4, $5, $6, $7, $8)");
+    c.prepare("del", "DELETE FROM \"production:order_content\" WHERE id=$1");
+}
+
+orderWriter::~orderWriter() {
+    delete pipe;
+}
+
+void orderWriter::insert(const order_content &ord) {
+    if (batchsize > 0) {
+        enqueue('I', 0, 0, ord);
+        return;
+    }
+
+    if (pipelined) {
+        string sql = "INSERT INTO \"production:order_content\" (date, customer, orderno, item_id, quantity, quota, barcode_id, exfdate) VALUES (";
+        for (int column = 0; column < OC_COLUMNCOUNT; column++) {
+            if (column == OC_EXFDATE) { // barcode_id sits between quota and exfdate
+                sql += txn.quote(ord.barcode_id) + ", ";
+            }
+            sql += literal(ord, column) + (column + 1 < OC_COLUMNCOUNT ? ", " : ")");
+        }
+        submit(sql, "INSERT " + ord.barcode_id);
+        return;
+    }
+
+    latencyTimer timer(metrics, "insert");
+    txn.prepared("add")(order_column_value(strings, ord, OC_DATE))(strings.str(ord.customer))(strings.str(ord.orderno))
+            (ord.item_id)(ord.quantity)(ord.quota)(ord.barcode_id)(order_column_value(strings, ord, OC_EXFDATE), ord.exfdate != 0).exec();
+}
+
+void orderWriter::update(int id, const order_content &ord, unsigned int columns) {
+    if (batchsize > 0) {
+        enqueue('U', id, columns, ord);
+        return;
+    }
+
+    if (pipelined) {
+        string sql = "UPDATE \"production:order_content\" SET ";
+        const char *separator = "";
+        for (int column = 0; column < OC_COLUMNCOUNT; column++) {
+            if (columns & OC_BIT(column)) {
+                sql += separator + string(order_column_names[column]) + "=" + literal(ord, column);
+                separator = ", ";
+            }
+        }
+        submit(sql + " WHERE id=" + to_string(id), "UPDATE " + ord.barcode_id);
+        return;
+    }
+
+    pqxx::prepare::invocation invocation = txn.prepared(prepareUpdate(columns));
+
+    for (int column = 0; column < OC_COLUMNCOUNT; column++) {
+        if (!(columns & OC_BIT(column))) {
+            continue;
+        }
+
+        switch (column) {
+            case OC_ITEM_ID: invocation(ord.item_id); break;
+            case OC_QUANTITY: invocation(ord.quantity); break;
+            case OC_QUOTA: invocation(ord.quota); break;
+            case OC_EXFDATE: invocation(order_column_value(strings, ord, column), ord.exfdate != 0); break;
+            default: invocation(order_column_value(strings, ord, column)); break;
+        }
+    }
+
+    latencyTimer timer(metrics, "update");
+    invocation(id).exec();
+}
+
+void orderWriter::remove(int id, const string &barcode_id) {
+    if (batchsize > 0) {
+        enqueue('D', id, 0, order_content());
+        return;
+    }
+
+    if (pipelined) {
+        submit("DELETE FROM \"production:order_content\" WHERE id=" + to_string(id), "DELETE " + barcode_id);
+        return;
+    }
+
+    latencyTimer timer(metrics, "delete");
+    txn.prepared("del")(id).exec();
+}
+
+// "UPDATE ... SET quantity=$1, quota=$2 WHERE id=$3" for a mask, prepared on first use
+string orderWriter::prepareUpdate(unsigned int columns) {
+    ostringstream name;
+    name << "update_" << hex << columns;
+
+    if (!preparedmasks[columns]) {
+        ostringstream sql;
+        int param = 1;
+
+        sql << "UPDATE \"production:order_content\" SET ";
+        for (int column = 0; column < OC_COLUMNCOUNT; column++) {
+            if (columns & OC_BIT(column)) {
+                sql << (param > 1 ? ", " : "") << order_column_names[column] << "=$" << param;
+                param++;
+            }
+        }
+        sql << " WHERE id=$" << param;
+
+        conn.prepare(name.str(), sql.str());
+        preparedmasks[columns] = true;
+    }
+
+    return name.str();
+}
+
+void orderWriter::enqueue(char op, int id, unsigned int columns, const order_content &ord) {
+    queued_write w;
+
+    w.op = op;
+    w.id = id;
+    w.columns = columns;
+    w.row = ord;
+    queue.push_back(w);
+
+    if (queue.size() >= batchsize) {
+        flush();
+    }
+}
+
+void orderWriter::flush() {
+    if (pipe != NULL) {
+        latencyTimer timer(metrics, "pipeline_drain");
+
+        collect(true);
+        if (failure.empty()) {
+            pipe->complete();
+        }
+        delete pipe;
+        pipe = NULL;
+
+        if (!failure.empty()) {
+            string message = "pipelined write failed: " + failure;
+            if (notrun > 0) {
+                message += " (" + to_string(notrun) + " statements not run)";
+            }
+            failure.clear();
+            notrun = 0;
+            throw runtime_error(message);
+        }
+    }
+
+    if (queue.empty()) {
+        return;
+    }
+
+    if (!staged) {
+        txn.exec("CREATE TEMP TABLE ordersync_stage (seq integer NOT NULL, op char(1) NOT NULL, id integer, columns integer, "
+                "date date, customer varchar(64), orderno varchar(64), item_id integer, quantity integer, "
+                "quota integer, barcode_id varchar(8), exfdate date) ON COMMIT DROP");
+        staged = true;
+    }
+
+    {
+        latencyTimer timer(metrics, "stage_copy");
+        pqxx::tablewriter stage(txn, "ordersync_stage", STAGENULL);
+        vector<string> row(12);
+
+        for (size_t i = 0; i < queue.size(); i++) {
+            const queued_write &w = queue[i];
+
+            row[0] = to_string(i);
+            row[1] = string(1, w.op);
+            row[2] = w.op == 'I' ? STAGENULL : to_string(w.id);
+            row[3] = to_string(w.columns);
+            if (w.op == 'D') {
+                for (int f = 4; f < 12; f++) {
+                    row[f] = STAGENULL;
+                }
+            } else {
+                isoDate(row[4], w.row.date);
+                row[5] = strings.str(w.row.customer);
+                row[6] = strings.str(w.row.orderno);
+                row[7] = to_string(w.row.item_id);
+                row[8] = to_string(w.row.quantity);
+                row[9] = to_string(w.row.quota);
+                row[10] = w.row.barcode_id;
+                if (w.row.exfdate == 0) {
+                    row[11] = STAGENULL;
+                } else {
+                    isoDate(row[11], w.row.exfdate);
+                }
+            }
+
+            stage << row;
+        }
+
+        stage.complete();
+    }
+
+    {
+        latencyTimer timer(metrics, "stage_update");
+        txn.exec(stagedUpdateSql());
+    }
+    {
+        latencyTimer timer(metrics, "stage_insert");
+        txn.exec("INSERT INTO \"production:order_content\" (date, customer, orderno, item_id, quantity, quota, barcode_id, exfdate) "
+                "SELECT date, customer, orderno, item_id, quantity, quota, barcode_id, exfdate "
+                "FROM ordersync_stage WHERE op = 'I' ORDER BY seq");
+    }
+    {
+        latencyTimer timer(metrics, "stage_delete");
+        txn.exec("DELETE FROM \"production:order_content\" oc USING ordersync_stage s WHERE s.op = 'D' AND oc.id = s.id");
+        txn.exec("TRUNCATE ordersync_stage");
+    }
+
+    queue.clear();
+}
+
+// One UPDATE ... FROM for the whole stage, touching only each row's changed columns
+string orderWriter::stagedUpdateSql() {
+    ostringstream sql;
+
+    sql << "UPDATE \"production:order_content\" oc SET ";
+    for (int column = 0; column < OC_COLUMNCOUNT; column++) {
+        sql << (column > 0 ? ", " : "") << order_column_names[column]
+                << " = CASE WHEN s.columns & " << OC_BIT(column) << " <> 0 THEN s." << order_column_names[column]
+                << " ELSE oc." << order_column_names[column] << " END";
+    }
+    sql << " FROM ordersync_stage s WHERE s.op = 'U' AND oc.id = s.id";
+
+    return sql.str();
+}
+
+// SQL literal for a column value, for statements sent through the pipeline
+string orderWriter::literal(const order_content &ord, int column) {
+    switch (column) {
+        case OC_ITEM_ID: return to_string(ord.item_id);
+        case OC_QUANTITY: return to_string(ord.quantity);
+        case OC_QUOTA: return to_string(ord.quota);
+        case OC_EXFDATE: return ord.exfdate == 0 ? "NULL" : txn.quote(order_column_value(strings, ord, column));
+        default: return txn.quote(order_column_value(strings, ord, column));
+    }
+    return "NULL";
+}
+
+void orderWriter::submit(const string &sql, const string &what) {
+    if (!failure.empty()) {
+        notrun++;
+        return;
+    }
+    if (pipe == NULL) {
+        pipe = new pqxx::pipeline(txn, "ordersync");
+    }
+
+    inflight[pipe->insert(sql)] = what;
+
+    // Pick up whatever already finished, and only block once the window is full
+    bool full = inflight.size() >= PIPELINEWINDOW;
+    latencyTimer timer(full ? metrics : NULL, "pipeline_wait");
+    collect(full);
+}
+
+// Retrieve finished results in submission order, up to the first failure;
+// the pipeline only reports "error in earlier query" for those after it.
+// With wait set, blocks until everything in flight has been retrieved.
+void orderWriter::collect(bool wait) {
+    while (!inflight.empty()) {
+        map<pqxx::pipeline::query_id, string>::iterator oldest = inflight.begin();
+
+        if (!failure.empty()) {
+            notrun += inflight.size();
+            inflight.clear();
+            break;
+        }
+        if (!wait && !pipe->is_finished(oldest->first)) {
+            break;
+        }
+
+        try {
+            pipe->retrieve(oldest->first);
+        } catch (const pqxx::sql_error &e) {
+            failure = oldest->second + ": " + e.what();
+        }
+        inflight.erase(oldest);
+    }
+}
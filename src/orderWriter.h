@@ -0,0 +1,86 @@
+/*
+ * File:   orderWriter.h
+ *
+ * Applies inserts, updates and deletes to production:order_content.
+ *
+ * With a batch size of 0 every write is its own prepared statement; an
+ * update sets exactly the changed columns in one statement, prepared once
+ * per distinct change mask.  Otherwise writes are queued and, once batchsize of
+ * them are waiting (and on flush()), COPYed into a temporary staging table
+ * and applied with one UPDATE ... FROM, one INSERT ... SELECT and one
+ * DELETE ... USING.
+ *
+ * In pipelined mode the same row-level statements are sent through a
+ * pqxx::pipeline instead, so the scan keeps going while the server works
+ * through them.  The first failed statement is tied back to the barcode that
+ * caused it; the server skips everything after it in the transaction, so
+ * from there on statements are only counted, and flush() throws with the
+ * failure and the number of statements not run.
+ *
+ * Given a syncMetrics, every statement (or pipeline wait) is timed into it.
+ *
+ * The rows' customer and orderno are ids in strings, which has to outlive
+ * the writer since queued rows are only resolved when they are sent.
+ */
+
+#ifndef ORDERWRITER_H
+#define ORDERWRITER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pqxx/pqxx>
+
+#include "order.h"
+#include "syncMetrics.h"
+
+using namespace std;
+
+class orderWriter {
+private:
+    struct queued_write {
+        char op; /* 'I'nsert, 'U'pdate or 'D'elete */
+        int id;
+        unsigned int columns; /* Columns to set on update */
+        order_content row;
+    };
+
+    pqxx::connection_base &conn;
+    pqxx::work &txn;
+    const stringPool &strings;
+    size_t batchsize;
+    bool staged; /* The staging table exists in this transaction */
+    vector<queued_write> queue;
+    vector<bool> preparedmasks; /* update_<mask> statements prepared so far */
+
+    bool pipelined;
+    pqxx::pipeline *pipe; /* Open while pipelined writes are in flight */
+    map<pqxx::pipeline::query_id, string> inflight; /* What each pipelined query was for */
+    string failure; /* The first failed statement and why, "" while none has */
+    size_t notrun; /* Statements after it */
+
+    syncMetrics *metrics; /* NULL when not instrumented */
+
+public:
+    orderWriter(pqxx::connection_base &c, pqxx::work &txn, const stringPool &strings, size_t batchsize = 0, bool pipelined = false, syncMetrics *metrics = NULL);
+    virtual ~orderWriter();
+
+    void insert(const order_content &ord);
+    // columns is a mask of OC_BIT(order_column) that differ from the DB row
+    void update(int id, const order_content &ord, unsigned int columns);
+    void remove(int id, const string &barcode_id);
+
+    // Apply whatever is still queued
+    void flush();
+
+private:
+    void enqueue(char op, int id, unsigned int columns, const order_content &ord);
+    string prepareUpdate(unsigned int columns);
+    string stagedUpdateSql();
+
+    string literal(const order_content &ord, int column);
+    void submit(const string &sql, const string &what);
+    void collect(bool wait);
+};
+
+#endif /* ORDERWRITER_H */
@@ -1,506 +1,1700 @@
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
+#include <cctype>
 #include <pqxx/pqxx>
 #include <cryptopp/sha.h>
 #include <sstream>
 #include <iomanip>
 #include <set>
-#include <boost/algorithm/string.hpp>
+#include <vector>
+#include <algorithm>
+#include <getopt.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <stdexcept>
+#include <csignal>
+#include <cerrno>
+#include <climits>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 
 using namespace std;
 
+#include "cdxReader.h"
 #include "dbfReader.h"
+#include "flatHash.h"
+#include "itemCache.h"
+#include "itemIndex.h"
+#include "order.h"
+#include "orderDiff.h"
+#include "orderSorter.h"
+#include "orderStage.h"
+#include "orderWriter.h"
+#include "stringPool.h"
+#include "syncSnapshot.h"
+#include "syncMetrics.h"
+#include "syncLog.h"
+#include "textUtil.h"
+
+// barcode_ids to reconcile in an incremental sync
+typedef flatHash<bool, 1> barcode_set;
+
+// Rows fetched per round trip while loading the reference maps
+#define MAPLOADBATCH 10000
+
+// prosheet.DBF records handed to a scan thread at a time
+#define SCANCHUNK 65536
+
+// Quiet time after the last change to prosheet.DBF before a watch mode sync, in ms
+#define WATCHDEBOUNCE 2000
+
+// Memory for sorting prosheet rows in a merge-join sync before spilling to disk, in MB
+#define MERGESORTMEMORY 64
+
+// prosheet.DBF fields used by the sync, bound and checked when the file is opened
+enum prosheet_field {
+    PS_CLOSECHK,
+    PS_PANTYCHK,
+    PS_YCONLY,
+    PS_ORDERNO,
+    PS_CUSTVAR,
+    PS_ARTCONO,
+    PS_ARTICLE,
+    PS_ORDDATE,
+    PS_BARCODE_ID,
+    PS_COLORWAY,
+    PS_SIZE,
+    PS_ORDERQTY,
+    PS_QUOTAQTY,
+    PS_KNIPROD,
+    PS_EXFDATE,
+    PS_FIELDCOUNT
+};
 
-struct order_content {
-    /*
-        id serial NOT NULL,
-        date date NOT NULL,
-        customer character varying(64) NOT NULL,
-        orderno character varying(64) NOT NULL,
-        item_id integer NOT NULL,
-        quantity integer NOT NULL,
-        quota integer NOT NULL,
-        barcode_id character varying(8) NOT NULL,
-        exfdate date,
-     */
-    int id;
-    string date;
-    string customer;
-    string orderno;
-    int item_id;
-    int quantity;
-    int quota;
-    string barcode_id;
-    string exfdate;
+static const dbfFieldSpec prosheetSchema[PS_FIELDCOUNT] = {
+    { "closechk", "LC", 1, -1},
+    { "pantychk", "LC", 1, -1},
+    { "yconly", "LC", 1, -1},
+    { "orderno", "C", 64, -1}, // order_content.orderno is varchar(64)
+    { "custvar", "C", 64, -1}, // order_content.customer is varchar(64)
+    { "artcono", "C", 0, -1},
+    { "article", "CM", 0, -1}, // may be a memo, only read for reports
+    { "orddate", "D", 8, -1},
+    { "barcode_id", "C", 8, -1}, // order_content.barcode_id is varchar(8)
+    { "colorway", "C", 0, -1},
+    { "size", "C", 0, -1},
+    { "orderqty", "NFI", 0, -1},
+    { "quotaqty", "NFI", 0, -1},
+    { "kniprod", NULL, 0, -1}, // only tested for blank
+    { "exfdate", "D", 8, -1}
+};
+
+// What a prosheet.DBF row turned out to be once decoded and looked up
+enum prosheet_row_kind {
+    ROW_FOUND, // item found as is
+    ROW_GUESS, // item found after trimming
+    ROW_ZERO_ORDER,
+    ROW_ZERO_PRODUCTION,
+    ROW_NOT_FOUND,
+    ROW_MALFORMED
+};
+
+// A scanned row; only depends on prosheet.DBF and the item index, so rows can
+// be scanned on any thread and merged into the sync later, in file order.
+// Its text is only interned into the sync's stringPool by the merge, which
+// runs on one thread.
+struct prosheet_row {
+    prosheet_row_kind kind;
+    order_content ord; // FOUND/GUESS: the row to sync, MALFORMED: barcode_id only
+    string customer; // FOUND/GUESS: ord.customer, until interned
+    string orderno; // FOUND/GUESS: ord.orderno, until interned
+    vector<string> details; // NOT_FOUND/MALFORMED: the values of the event raised for it
+};
+
+// The filter columns of a batch of prosheet.DBF records, projected once per
+// batch for the rows the prefilter left, and the rows of the batch left to scan
+struct prosheet_columns {
+    vector<uint64_t> survivors; // prefilter bitmap: not deleted, pantychk and yconly not set
+    vector<uint8_t> kniprodBlank;
+    dbfColumn<int32_t> orddate;
+    dbfColumn<int32_t> exfdate;
+    dbfColumn<int64_t> orderqty;
+    dbfColumn<int64_t> quotaqty;
+    vector<uint8_t> closechk; // flag set, exactly "T" like pantychk and yconly
+    vector<uint32_t> selection; // rows passing the filters, in order
+};
+
+struct sync_stats {
+    // sock_item identification
+    int total;
+    int zeroorder;
+    int zeroproduction;
+    int ignore;
+    int guess;
+    int found;
+    int malformed;
+
+    // order synchronization
+    int total_pre;
+    int pass;
+    int update;
+    int insert;
+    int del;
+    int total_post;
+
+    // incremental sync
+    int unchanged;
+
+    sync_stats() : total(0), zeroorder(0), zeroproduction(0), ignore(0), guess(0), found(0), malformed(0),
+    total_pre(0), pass(0), update(0), insert(0), del(0), total_post(0), unchanged(0) {
+    }
 };
 
-struct order {
-    /*
-        id integer NOT NULL DEFAULT nextval('"production:order_id_seq1"'::regclass),
-        name character varying(128) NOT NULL,
-        customer character varying(128) NOT NULL,
-        subclass character varying(128) NOT NULL,
-        date date NOT NULL,
-        order_group_id integer,
-     */
-    int id;
-    string name;
-    string customer;
-    // string subclass;
-    string date;
+struct sync_options {
+    string dbstring;
+    string dbffile;
+    bool mapped;
+    size_t batchsize;
+    bool pipelined;
+    int threads;
+    string snapshotfile;
+    string itemcachefile; // "" for none
+    bool watch;
+    string metricsfile; // "" when not instrumented
+    metrics_format metricsformat;
+    bool dryrun;
+    size_t mergememory; // merge-join sort memory in bytes, 0 to reconcile through the order_content map
+    string indexfile; // .cdx/.idx with a BARCODE_ID tag to merge-join in index order, "" for none
+    bool serverjoin; // stage the prosheet rows and reconcile them on the server
 };
 
-int sync(pqxx::work &txn, map<string, order_content> &m, order_content ord);
+// Where merge_join takes the prosheet rows from, in barcode order
+typedef function<bool(sorted_row &row)> sorted_rows;
+
+// The report of the syncs, raised on the sync's thread only
+static syncLog events;
+
+bool parse_number(const char *text, long min, long max, long &value);
+int sync_once(pqxx::connection_base &c, const sync_options &opts, itemCache &items, syncMetrics &metrics);
+int watch(pqxx::connection_base &c, const sync_options &opts, itemCache &items, syncMetrics &metrics, int debounce);
+void apply_change(const stringPool &strings, orderWriter *writer, const order_change &change);
+void select_rows(dbfReader &reader, const dbfBoundField *ps, const dbfBatch &batch, barcode_set *changed, prosheet_columns &cols);
+void classify_row(dbfReader &reader, const dbfBoundField *ps, const dbfBatch &batch, const prosheet_columns &cols, size_t i,
+        itemIndex &items, prosheet_row &row);
+bool scan_row(dbfReader &reader, const dbfBoundField *ps, itemIndex &items, prosheet_columns &cols, prosheet_row &row);
+void tally_change(const order_change &change, sync_stats &stats);
+bool count_row(const prosheet_row &row, sync_stats &stats);
+void intern_row(stringPool &strings, prosheet_row &row);
+void merge_row(prosheet_row &row, stringPool &strings, orderDiff &diff, orderSink *aside, orderWriter *writer, sync_stats &stats);
+void scan_parallel(const string &dbffile, bool mapped, int threads, unsigned int recordcount, barcode_set *changed,
+        itemIndex &items, stringPool &strings, orderDiff &diff, orderSink *aside, orderWriter *writer, sync_stats &stats,
+        syncMetrics *metrics);
+int merge_join(pqxx::work &txn, const sorted_rows &rows, stringPool &strings, orderWriter *writer, sync_stats &stats);
+int server_join(pqxx::work &txn, stringPool &strings, syncMetrics *metrics, sync_stats &stats);
+void open_index(cdxReader &index, const string &filename, unsigned int recordcount);
+bool next_indexed_row(cdxReader &index, dbfReader &reader, const dbfBoundField *ps, itemIndex &items, stringPool &strings,
+        prosheet_columns &cols, sync_stats &stats, sorted_row &sorted);
+void take_snapshot(dbfReader &reader, const dbfBoundField *ps, syncSnapshot &snapshot);
+int snapshot_changes(syncSnapshot &previous, syncSnapshot &current, barcode_set &changed, vector<string> &barcodes);
+void fingerprint_order_content(pqxx::work &txn, uint32_t &rowcount, int64_t &xminsum);
+void generate_changed_order_content_map(pqxx::work &txn, const vector<string> &barcodes, stringPool &strings,
+        order_content_index &m, set<string> &s);
 void generate_order_map(pqxx::work &txn, map<string, order> &m, set<string> &s);
-void generate_order_content_map(pqxx::work &txn, map<string, order_content> &m, set<string> &s);
-void generate_item_map(pqxx::work &txn, map<string, int> &m, map<string, int> &m_trim);
-string trim(string str);
-string flatten_key(string artcono, string color, string size);
-string getKey(order_content ord);
-string isoDate(string date);
+void generate_order_content_map(pqxx::work &txn, stringPool &strings, order_content_index &m, set<string> &s, const string &where = "");
+void read_order_content(const pqxx::result &r, pqxx::result::size_type i, stringPool &strings, order_content &ord, int first = 0);
+void generate_item_map(pqxx::work &txn, itemIndex &items);
+string item_version(pqxx::work &txn);
+void refresh_items(pqxx::work &txn, const sync_options &opts, itemCache &items);
+void write_metrics(const sync_options &opts, syncMetrics &metrics, bool failed);
+void report_row(log_category category, const vector<string> &details);
+void report_notice(const string &message);
+void report_update(const stringPool &strings, const order_content &from, const order_content &to, unsigned int columns);
 
 int main(int argc, char** argv) {
 
-    if (argc != 3) {
-        cout << "Usage: ordersync [db.conf] [prosheet.dbf file]" << endl;
+    // Options
+    //  --mmap    - map prosheet.DBF instead of reading it through stdio; not with --watch, where
+    //              FoxPro shrinking the file under a sync would kill ordersync with SIGBUS
+    //  --batch=N - stage writes and apply them set-based, N rows at a time
+    //  --pipeline - send writes through a pipeline instead of one round trip each; not with
+    //               --merge-join or --index, whose cursor can't fetch while the pipeline is open
+    //  --threads=N - decode and look up prosheet.DBF rows on N threads
+    //  --snapshot=FILE - only reconcile records changed since the sync that wrote FILE; costs a
+    //                    count and xmin sum over all of production:order_content before the commit
+    //                    (and, with FILE there, again up front), plus item_version() of the sock
+    //                    tables unless --watch or --item-cache already takes it
+    //  --item-cache=FILE - keep the item index in FILE, and only build it from the sock tables
+    //                      again when they change
+    //  --watch[=MS] - keep running, and sync again MS ms after prosheet.DBF stops changing
+    //  --metrics=FILE - append per stage timings, statement latencies and peak RSS to FILE as JSON lines
+    //  --metrics-format=json|prometheus - or keep FILE as a Prometheus textfile instead
+    //  --dry-run - report what the sync would change, in a read-only transaction
+    //  --merge-join[=MB] - don't load production:order_content, stream it in barcode order and merge
+    //                      it with the prosheet rows, sorted in MB of memory (spilling to disk)
+    //  --index=FILE - merge-join without sorting, reading prosheet.DBF in the order of the
+    //                 BARCODE_ID tag of FILE (its .cdx, or a .idx on barcode_id)
+    //  --server-join - don't load production:order_content, COPY the prosheet rows to a staging
+    //                  table and reconcile them on the server (can't be a dry run)
+    //  --log=FILE - append the report (changes, skipped rows, notices) to FILE instead of stdout
+    //  --log-format=text|json - the usual lines, or one JSON object per event
+    //  --verbosity=N - 0 for no report, 1 for notices and malformed rows, 2 for everything (default)
+    //  --log-rate=N - at most N events of each kind per second, the rest are only counted
+    sync_options opts;
+    opts.mapped = false;
+    opts.batchsize = 0;
+    opts.pipelined = false;
+    opts.threads = 1;
+    opts.watch = false;
+    opts.metricsformat = METRICS_JSON;
+    opts.dryrun = false;
+    opts.mergememory = 0;
+    opts.serverjoin = false;
+    int debounce = WATCHDEBOUNCE;
+    string logfile;
+    log_format logformat = LOG_TEXT;
+    int verbosity = LOGALL;
+    int lograte = 0;
+    bool badopt = false;
+
+    static struct option longopts[] = {
+        { "mmap", no_argument, NULL, 'm'},
+        { "batch", required_argument, NULL, 'b'},
+        { "pipeline", no_argument, NULL, 'p'},
+        { "threads", required_argument, NULL, 't'},
+        { "snapshot", required_argument, NULL, 's'},
+        { "item-cache", required_argument, NULL, 'c'},
+        { "watch", optional_argument, NULL, 'w'},
+        { "metrics", required_argument, NULL, 'M'},
+        { "metrics-format", required_argument, NULL, 'F'},
+        { "dry-run", no_argument, NULL, 'n'},
+        { "merge-join", optional_argument, NULL, 'j'},
+        { "index", required_argument, NULL, 'x'},
+        { "server-join", no_argument, NULL, 'S'},
+        { "log", required_argument, NULL, 'l'},
+        { "log-format", required_argument, NULL, 'o'},
+        { "verbosity", required_argument, NULL, 'v'},
+        { "log-rate", required_argument, NULL, 'r'},
+        { NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    long number = 0;
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                opts.mapped = true;
+                break;
+            case 'b':
+                badopt |= !parse_number(optarg, 0, INT_MAX, number);
+                opts.batchsize = number;
+                break;
+            case 'p':
+                opts.pipelined = true;
+                break;
+            case 't':
+                badopt |= !parse_number(optarg, 1, INT_MAX, number);
+                opts.threads = number;
+                break;
+            case 's':
+                opts.snapshotfile = optarg;
+                break;
+            case 'c':
+                opts.itemcachefile = optarg;
+                break;
+            case 'w':
+                opts.watch = true;
+                if (optarg != NULL) {
+                    badopt |= !parse_number(optarg, 0, INT_MAX, number);
+                    debounce = number;
+                }
+                break;
+            case 'M':
+                opts.metricsfile = optarg;
+                break;
+            case 'F':
+                if (strcmp(optarg, "prometheus") == 0) {
+                    opts.metricsformat = METRICS_PROMETHEUS;
+                } else if (strcmp(optarg, "json") != 0) {
+                    badopt = true;
+                }
+                break;
+            case 'n':
+                opts.dryrun = true;
+                break;
+            case 'j':
+                number = MERGESORTMEMORY;
+                if (optarg != NULL) {
+                    badopt |= !parse_number(optarg, 1, INT_MAX, number);
+                }
+                opts.mergememory = (size_t) number << 20;
+                break;
+            case 'x':
+                opts.indexfile = optarg;
+                break;
+            case 'S':
+                opts.serverjoin = true;
+                break;
+            case 'l':
+                logfile = optarg;
+                break;
+            case 'o':
+                if (strcmp(optarg, "json") == 0) {
+                    logformat = LOG_JSON;
+                } else if (strcmp(optarg, "text") != 0) {
+                    badopt = true;
+                }
+                break;
+            case 'v':
+                badopt |= !parse_number(optarg, LOGQUIET, LOGALL, number);
+                verbosity = number;
+                break;
+            case 'r':
+                badopt |= !parse_number(optarg, 0, INT_MAX, number);
+                lograte = number;
+                break;
+            default:
+                badopt = true;
+        }
+    }
+
+    if (badopt || argc - optind != 2 || (opts.batchsize > 0 && opts.pipelined) || (opts.mergememory > 0 && !opts.indexfile.empty()) ||
+            (opts.serverjoin && (opts.mergememory > 0 || !opts.indexfile.empty() || opts.dryrun)) || (opts.mapped && opts.watch) ||
+            (opts.pipelined && (opts.mergememory > 0 || !opts.indexfile.empty()))) {
+        cout << "Usage: ordersync [--mmap | --watch[=MS]] [--batch=N | --pipeline] [--threads=N] [--snapshot=FILE] [--item-cache=FILE] [--metrics=FILE [--metrics-format=json|prometheus]] [--dry-run] [--merge-join[=MB] | --index=FILE | --server-join] [--log=FILE] [--log-format=text|json] [--verbosity=N] [--log-rate=N] [db.conf] [prosheet.dbf file]" << endl;
         return 1;
     }
 
     // Parameters
     // 1 - configuration filename
     // 2 - prosheet.DBF location
-    string dbconf(argv[1]);
-    string dbffile(argv[2]);
+    string dbconf(argv[optind]);
+    opts.dbffile = argv[optind + 1];
 
     // Get dbstring from 1st parameter
     ifstream dbconfin;
     dbconfin.open(dbconf);
-    string dbstring;
-    getline(dbconfin, dbstring);
+    getline(dbconfin, opts.dbstring);
+
+    string logError;
+    if (!events.open(logfile, logformat, verbosity, lograte, logError)) {
+        cerr << "Log not opened: " << logError << endl;
+        return 1;
+    }
+
+    // Outside the try, so a sync that throws still writes what it got through
+    syncMetrics metrics;
 
     try {
-        // Database connection & transaction
-        pqxx::connection c(dbstring);
-        pqxx::work txn(c);
-
-        // Maps and sets
-        map<string, int> m;
-        map<string, int> mTrim;
-        map<string, order> orderMap;
-        set<string> sOrderNo;
-        set<string> sBarcodeId;
-        map<string, order_content> orderContentMap;
-
-        // Build the maps from DB
-        generate_item_map(txn, m, mTrim);
+        // Database connection, kept across syncs in watch mode
+        uint64_t connectWall = syncMetrics::wallNow();
+        uint64_t connectCpu = syncMetrics::cpuNow();
+        pqxx::connection c(opts.dbstring);
+        metrics.addStage("connect", syncMetrics::wallNow() - connectWall, syncMetrics::cpuNow() - connectCpu);
+
+        itemCache items;
+        int status;
+
+        if (opts.watch) {
+            status = watch(c, opts, items, metrics, debounce);
+        } else {
+            status = sync_once(c, opts, items, metrics);
+        }
+
+        // Close DB connection
+        c.disconnect();
+
+        return status;
+    } catch (const pqxx::pqxx_exception &e) {
+        cerr << "pqxx_exception: " << e.base().what() << endl;
+    } catch (const std::exception &e) {
+        cerr << "exception: " << e.what() << endl;
+    }
+
+    write_metrics(opts, metrics, true);
+    return 1;
+}
+
+// A whole decimal number in [min, max] and nothing else: no blanks, no
+// trailing text, and no sign unless min is negative
+bool parse_number(const char *text, long min, long max, long &value) {
+    char *end;
+
+    if (!isdigit((unsigned char) *text) && !(min < 0 && *text == '-')) {
+        return false;
+    }
+
+    errno = 0;
+    value = strtol(text, &end, 10);
+    return *end == '\0' && errno == 0 && value >= min && value <= max;
+}
+
+// One sync of prosheet.DBF into production:order_content, in its own transaction
+// return: exit status
+int sync_once(pqxx::connection_base &c, const sync_options &opts, itemCache &items, syncMetrics &metrics) {
+    syncMetrics *instrumented = opts.metricsfile.empty() ? NULL : &metrics;
+    pqxx::work txn(c);
+
+    // A dry run can't write, so it also works against a read-only replica
+    if (opts.dryrun) {
+        txn.exec("SET TRANSACTION READ ONLY");
+    }
+    // Dates are read back packed, which takes them as yyyy-mm-dd
+    txn.exec("SET LOCAL DateStyle TO ISO");
+
+    // Maps and sets
+    map<string, order> orderMap;
+    set<string> sOrderNo;
+    set<string> sBarcodeId;
+    order_content_index orderContentMap;
+
+    // customer and orderno of every order_content row of this sync, DB and
+    // prosheet alike
+    stringPool strings;
+
+    // Prepare for FoxPro DBF reading...
+    dbfReader reader;
+    dbfBoundField ps[PS_FIELDCOUNT];
+    string layoutError;
+    bool bound;
+    {
+        stageTimer timer(instrumented, "dbf_open");
+        reader.open(opts.dbffile, opts.mapped);
+
+        // Bind the fields used below, bailing out before any writes if the
+        // prosheet layout has drifted from what the sync expects
+        bound = reader.bind(prosheetSchema, PS_FIELDCOUNT, ps, layoutError);
+        timer.count(reader.recordCount(), reader.headerLength() + (uint64_t) reader.recordCount() * reader.recordLength());
+    }
+    if (!bound) {
+        cerr << "Unexpected prosheet.DBF layout:" << endl << layoutError;
+        write_metrics(opts, metrics, true);
+        return 1;
+    }
+
+    // Build the maps from DB
+    {
+        stageTimer timer(instrumented, "load_item_map");
+        if (opts.watch || !opts.itemcachefile.empty()) {
+            refresh_items(txn, opts, items);
+        } else {
+            generate_item_map(txn, items.index);
+        }
+        timer.count(items.index.size());
+    }
+    {
+        stageTimer timer(instrumented, "load_order_map");
         generate_order_map(txn, orderMap, sOrderNo);
-        generate_order_content_map(txn, orderContentMap, sBarcodeId);
-
-        // Stats
-        int total = 0;
-        int zeroorder = 0;
-        int zeroproduction = 0;
-        int ignore = 0;
-        int guess = 0;
-        int found = 0;
-        
-        // Stats
-        int total_pre = orderContentMap.size();
-        int pass = 0;
-        int update = 0;
-        int insert = 0;
-        int del = 0;
-        int total_post = 0;
-
-        // Prepare for FoxPro DBF reading...
-        dbfReader reader;
-        reader.open(dbffile);
-
-        // Find field indices
-        int closechkIdx = reader.getFieldIndex("closechk");
-        int pantychkIdx = reader.getFieldIndex("pantychk");
-        int yconlyIdx = reader.getFieldIndex("yconly");
-        int ordernoIdx = reader.getFieldIndex("orderno");
-        int custvarIdx = reader.getFieldIndex("custvar");
-        int artconoIdx = reader.getFieldIndex("artcono");
-        int articleIdx = reader.getFieldIndex("article");
-        int orddateIdx = reader.getFieldIndex("orddate");
-        int barcode_idIdx = reader.getFieldIndex("barcode_id");
-        int colorwayIdx = reader.getFieldIndex("colorway");
-        int sizeIdx = reader.getFieldIndex("size");
-        int orderqtyIdx = reader.getFieldIndex("orderqty");
-        int quotaqtyIdx = reader.getFieldIndex("quotaqty");
-        int kniprodIdx = reader.getFieldIndex("kniprod");
-        int exfdateIdx = reader.getFieldIndex("exfdate");
-
-        // Field variables
-        string closechk;
-        string pantychk;
-        string yconly;
-        string kniprod;
-
-        string orderno;
-        string custvar;
-        string artcono;
-        string orddate;
-        string barcode_id;
-        string colorway;
-        string size;
-        string orderqty;
-        string quotaqty;
-        string exfdate;
-
-        // SQL prepared statements
-        c.prepare("add", "INSERT INTO \"production:order_content\" (date, customer, orderno, item_id, quantity, quota, barcode_id, exfdate) VALUES ($1, $2, $3, $4, $5, $6, $7, $8)");
-        c.prepare("update_date", "UPDATE \"production:order_content\" SET date=$1 WHERE id=$2");
-        c.prepare("update_customer", "UPDATE \"production:order_content\" SET customer=$1 WHERE id=$2");
-        c.prepare("update_orderno", "UPDATE \"production:order_content\" SET orderno=$1 WHERE id=$2");
-        c.prepare("update_item_id", "UPDATE \"production:order_content\" SET item_id=$1 WHERE id=$2");
-        c.prepare("update_quantity", "UPDATE \"production:order_content\" SET quantity=$1 WHERE id=$2");
-        c.prepare("update_quota", "UPDATE \"production:order_content\" SET quota=$1 WHERE id=$2");
-        c.prepare("update_exfdate", "UPDATE \"production:order_content\" SET exfdate=$1 WHERE id=$2");
-        c.prepare("del", "DELETE FROM \"production:order_content\" WHERE id=$1");
-
-        // Temporaries
-        int item;
-        order_content tmpOrder;
-        int syncState;
-
-        // Loop through the items in prosheet.DBF
-        while (reader.next()) {
-
-            if (reader.isClosedRow()) { // Skip closed rows
-                continue;
-            }
+        timer.count(orderMap.size());
+    }
 
-            custvar = reader.getString(custvarIdx);
-            orderno = reader.getString(ordernoIdx);
-            barcode_id = reader.getString(barcode_idIdx);
+    // Stats
+    sync_stats stats;
 
-            closechk = reader.getString(closechkIdx);
-            pantychk = reader.getString(pantychkIdx);
-            yconly = reader.getString(yconlyIdx);
-            kniprod = reader.getString(kniprodIdx);
+    // With a snapshot from the last sync, only the barcodes whose records
+    // changed since are loaded and reconciled; a missing, stale or corrupt
+    // snapshot (or one that would save little) means a full sync
+    syncSnapshot previous;
+    syncSnapshot current;
+    barcode_set changedBarcodes;
+    barcode_set *changed = NULL;
 
-            artcono = reader.getString(artconoIdx);
-            colorway = reader.getString(colorwayIdx);
-            size = reader.getString(sizeIdx);
+    vector<string> barcodes;
 
-            orddate = reader.getString(orddateIdx);
-            orderqty = reader.getString(orderqtyIdx);
-            quotaqty = reader.getString(quotaqtyIdx);
-            exfdate = reader.getString(exfdateIdx);
+    if (!opts.snapshotfile.empty()) {
+        string reason;
 
-            // Skip invalid rows
-            if (orderqty == "") { // orderqty should be present.
-                continue;
+        {
+            stageTimer timer(instrumented, "snapshot");
+            current.describe(reader, opts.dbstring);
+            take_snapshot(reader, ps, current);
+            timer.count(current.recordcount, (uint64_t) current.recordcount * current.recordlength);
+        }
+        // The version the item index was built at, when refresh_items() did
+        // build it; the order_content fingerprint is a full scan of the
+        // table, so it is only taken up front against a snapshot
+        current.itemversion = !items.version.empty() ? items.version : item_version(txn);
+        if (previous.load(opts.snapshotfile, reason)) {
+            fingerprint_order_content(txn, current.rowcount, current.xminsum);
+            reason = previous.staleness(current);
+        }
+        if (reason.empty()) {
+            stats.unchanged = snapshot_changes(previous, current, changedBarcodes, barcodes);
+            if (stats.unchanged * 2 < (int) current.recordcount) {
+                reason = "most of prosheet.DBF changed";
             }
+        }
 
-            if (quotaqty == "") { // quotaqty should be present.
-                continue;
-            }
+        if (reason.empty()) {
+            changed = &changedBarcodes;
+            stats.total_pre = current.rowcount;
+        } else {
+            report_notice("FULL SYNC: " + reason);
+            stats.unchanged = 0;
+        }
 
-            if (orddate == "") {
-                continue;
-            }
+        // The old snapshot no longer matches the DB once anything is written;
+        // the new one replaces it only after this sync commits
+        if (!opts.dryrun) {
+            remove(opts.snapshotfile.c_str());
+        }
+    }
 
-            if (pantychk == "T") {
-                continue;
-            }
+    // A full merge-join sync leaves production:order_content on the server
+    // until the scan is over (or, through an index, until it is done in the
+    // join), and a server join leaves it there altogether; an incremental
+    // one only loads the changed barcodes anyway, so it goes through the map
+    bool joined = (opts.mergememory > 0 || !opts.indexfile.empty() || opts.serverjoin) && changed == NULL;
+    cdxReader index;
+    orderSorter sorter(opts.mergememory);
+    orderStage stage(txn, strings);
+    orderSorter *sorted = joined && opts.mergememory > 0 ? &sorter : NULL;
+    orderStage *staged = joined && opts.serverjoin ? &stage : NULL;
+    orderSink *aside = staged != NULL ? (orderSink *) staged : sorted;
+
+    if (joined && !opts.indexfile.empty()) {
+        stageTimer timer(instrumented, "index_open");
+        open_index(index, opts.indexfile, reader.recordCount());
+        timer.count(reader.recordCount());
+    }
 
-            if (yconly == "T") {
-                continue;
-            }
+    if (!joined) {
+        stageTimer timer(instrumented, "load_order_content_map");
+        if (changed != NULL) {
+            generate_changed_order_content_map(txn, barcodes, strings, orderContentMap, sBarcodeId);
+        } else {
+            generate_order_content_map(txn, strings, orderContentMap, sBarcodeId);
+        }
+        timer.count(orderContentMap.size());
+    }
+    if (changed == NULL) {
+        stats.total_pre = orderContentMap.size();
+    }
 
-            if (closechk == "T" && kniprod.empty()) {
-                continue;
-            }
+    // Matches prosheet rows against production:order_content (the map, or
+    // the stream after the scan); the changes go to writer, or nowhere in a
+    // dry run
+    orderDiff diff(orderContentMap);
+    orderWriter writer(c, txn, strings, opts.batchsize, opts.pipelined, instrumented);
+    orderWriter *applied = opts.dryrun ? NULL : &writer;
 
-            // Find item id, and sync accordingly
-            item = m[flatten_key(artcono, colorway, size)];
-            if (item == 0) {
-                item = mTrim[flatten_key(trim(artcono), trim(colorway), trim(size))];
-                if (item == 0) {
-                    if (orderqty != "0.00" /* && orderqty != "" */) {
-                        if (!kniprod.empty()) { // kniprod
-                            cout << " IGNORE NOT FOUND - " << orddate
-                                    << " : [" << artcono << "] " << reader.getString(articleIdx) << ", " << colorway << ", " << size
-                                    << " = " << orderqty << ", " << kniprod << endl;
-
-                            ignore++;
-                        } else {
-                            // cout << " IGNORE 0 kniprod: [" << artcono << "] " << reader.getString(articleIdx) << ", " << colorway << ", " << size << endl;
-                            zeroproduction++;
-                        }
-                    } else {
-                        // cout << " IGNORE 0 order: [" << artcono << "] " << reader.getString(articleIdx) << ", " << colorway << ", " << size << endl;
-                        zeroorder++;
-                    }
-                } else {
-                    // should be synced, trimmed
-                    tmpOrder.customer = custvar;
-                    tmpOrder.date = isoDate(orddate);
-                    tmpOrder.item_id = item;
-                    tmpOrder.orderno = orderno;
-                    tmpOrder.quantity = stoi(orderqty);
-                    tmpOrder.quota = stoi(quotaqty);
-                    tmpOrder.barcode_id = barcode_id;
-                    tmpOrder.exfdate = isoDate(exfdate);
-
-                    syncState = sync(txn, orderContentMap, tmpOrder);
-                    if (syncState < 0) {
-                        insert++;
-                    } else if (syncState == 0) {
-                        pass++;
-                    } else {
-                        update++;
+    // Loop through the items in prosheet.DBF, unless the join does through the index
+    if (!joined || aside != NULL) {
+        stageTimer timer(instrumented, "scan");
+
+        if (staged != NULL) {
+            staged->begin();
+        }
+
+        if (opts.threads > 1) {
+            scan_parallel(opts.dbffile, opts.mapped, opts.threads, reader.recordCount(), changed, items.index, strings, diff, aside, applied, stats,
+                    instrumented);
+        } else {
+            // decode (projection, filter and item lookup) and reconcile
+            // (diff, report and write) are timed per row, wall clock only
+            dbfBatch batch;
+            prosheet_columns cols;
+            prosheet_row row;
+            uint64_t decodeWall = 0;
+            uint64_t reconcileWall = 0;
+            uint64_t started = 0;
+
+            while (reader.nextBatch(batch)) {
+                if (instrumented != NULL) {
+                    started = syncMetrics::wallNow();
+                }
+                select_rows(reader, ps, batch, changed, cols);
+
+                for (size_t s = 0; s < cols.selection.size(); s++) {
+                    classify_row(reader, ps, batch, cols, cols.selection[s], items.index, row);
+                    if (instrumented != NULL) {
+                        uint64_t now = syncMetrics::wallNow();
+                        decodeWall += now - started;
+                        started = now;
                     }
 
-                    guess++;
+                    merge_row(row, strings, diff, aside, applied, stats);
+                    if (instrumented != NULL) {
+                        uint64_t now = syncMetrics::wallNow();
+                        reconcileWall += now - started;
+                        started = now;
+                    }
                 }
-            } else {
-                // should be synced, not trimmed
-                // if current row is in orderMap, check each item. if diff, update. remove from orderMap
-                // if not in orderMap, insert into DB.
-                tmpOrder.customer = custvar;
-                tmpOrder.date = isoDate(orddate);
-                tmpOrder.item_id = item;
-                tmpOrder.orderno = orderno;
-                tmpOrder.quantity = stoi(orderqty);
-                tmpOrder.quota = stoi(quotaqty);
-                tmpOrder.barcode_id = barcode_id;
-                tmpOrder.exfdate = isoDate(exfdate);
-
-                syncState = sync(txn, orderContentMap, tmpOrder);
-                if (syncState < 0) {
-                    insert++;
-                } else if (syncState == 0) {
-                    pass++;
-                } else {
-                    update++;
+                if (instrumented != NULL) {
+                    decodeWall += syncMetrics::wallNow() - started;
                 }
+            }
 
-                found++;
+            if (instrumented != NULL) {
+                instrumented->addStage("decode", decodeWall, 0, reader.recordCount());
+                instrumented->addStage("reconcile", reconcileWall, 0, stats.total);
             }
+        }
+        timer.count(reader.recordCount(), (uint64_t) reader.recordCount() * reader.recordLength());
+    }
+
+    if (joined) {
+        stageTimer timer(instrumented, "merge_join");
+        int dbrows;
+
+        if (staged != NULL) {
+            staged->finish();
+            dbrows = server_join(txn, strings, instrumented, stats);
+        } else if (sorted != NULL) {
+            sorted->finish();
+            dbrows = merge_join(txn, [&](sorted_row &row) {
+                return sorted->next(row);
+            }, strings, applied, stats);
+        } else {
+            prosheet_columns cols;
+
+            dbrows = merge_join(txn, [&](sorted_row &row) {
+                return next_indexed_row(index, reader, ps, items.index, strings, cols, stats, row);
+            }, strings, applied, stats);
+        }
+        if (changed == NULL) {
+            stats.total_pre = dbrows;
+        }
+        timer.count(dbrows);
+    }
+
+    // Release resources; the item index stays warm for the next sync in watch mode
+    if (!opts.watch) {
+        items.clear();
+    }
+    reader.close();
+    sBarcodeId.clear();
+    
+    // if orderMap not empty, remove from DB, in barcode order
+    {
+        stageTimer timer(instrumented, "delete");
+        vector<order_change> leftover;
+
+        diff.leftovers(leftover);
+        for (size_t i = 0; i < leftover.size(); i++) {
+            apply_change(strings, applied, leftover[i]);
+            tally_change(leftover[i], stats);
+        }
+        timer.count(leftover.size());
+    }
+    if (!opts.dryrun) {
+        stageTimer timer(instrumented, "flush");
+        writer.flush();
+    }
+
+    // Release orderMap
+    orderContentMap.clear();
+    
+    stats.total_post = stats.total_pre + stats.insert - stats.del;
+
+    // What the next incremental sync has to find unchanged, taken before the
+    // commit so that it covers exactly what this sync wrote
+    if (!opts.snapshotfile.empty() && !opts.dryrun) {
+        fingerprint_order_content(txn, current.rowcount, current.xminsum);
+    }
 
-            total++;
-        }
-
-        // Release resources
-        m.clear();
-        mTrim.clear();
-        reader.close();
-        sBarcodeId.clear();
-        
-        // if orderMap not empty, remove from DB
-        for (auto itr = orderContentMap.begin(); itr != orderContentMap.end(); itr++) {
-            cout << " DELETE " << itr->first << endl;
-            txn.prepared("del")(itr->second.id).exec();
-            del++;
-        }
-        
-        // Release orderMap
-        orderContentMap.clear();
-        
-        // Commit changes made to SQL
+    // Commit changes made to SQL
+    if (opts.dryrun) {
+        txn.abort();
+    } else {
+        stageTimer timer(instrumented, "commit");
         txn.commit();
+    }
 
-        // Display statistics
-        cout << "Stats (sock_item Identification)" << endl
-                << " Total             = " << total << endl
-                << " Found             = " << found << " (" << found * 100.0 / total << "%)" << endl
-                << " Guessed           = " << guess << " (" << guess * 100.0 / total << "%)" << endl
-                << " Ignored 0 Prod    = " << zeroproduction << " (" << zeroproduction * 100.0 / total << "%)" << endl
-                << " Ignored 0 Order   = " << zeroorder << " (" << zeroorder * 100.0 / total << "%)" << endl
-                << " Ignored Not Found = " << ignore << " (" << ignore * 100.0 / total << "%)" << endl;
-
-        // Stats
-//        int total_pre = 0;
-//        int pass = 0;
-//        int update = 0;
-//        int insert = 0;
-//        int del = 0;
-//        int total_post = 0;
-        total_post = total_pre + insert - del;
-
-        cout << "Stats (order Synchronization)" << endl
-                << " Total Initial   = " << total_pre << endl
-                << " Passed          = " << pass << endl
-                << " Updated         = " << update << endl
-                << " Inserted    (+) = " << insert << endl
-                << " Deleted     (-) = " << del << endl
-                << " Total Final     = " << total_post << endl;
-                
-        // Close DB connection
-        c.disconnect();
+    if (!opts.snapshotfile.empty() && !opts.dryrun) {
+        stageTimer timer(instrumented, "snapshot_save");
+        string snapshotError;
 
-    } catch (const pqxx::pqxx_exception &e) {
-        cerr << "pqxx_exception: " << e.base().what() << endl;
-        return 1;
-    } catch (const std::exception &e) {
-        cerr << "exception: " << e.what() << endl;
+        if (!current.save(opts.snapshotfile, snapshotError)) {
+            cerr << "Snapshot not saved, the next sync will be a full one: " << snapshotError << endl;
+        }
+    }
+
+    // Display statistics, after the report of the sync
+    events.flush();
+    cout << "Stats (sock_item Identification)" << endl;
+    if (changed != NULL) {
+        cout << " Unchanged         = " << stats.unchanged << endl;
+    }
+    cout << " Total             = " << stats.total << endl
+            << " Found             = " << stats.found << " (" << stats.found * 100.0 / stats.total << "%)" << endl
+            << " Guessed           = " << stats.guess << " (" << stats.guess * 100.0 / stats.total << "%)" << endl
+            << " Ignored 0 Prod    = " << stats.zeroproduction << " (" << stats.zeroproduction * 100.0 / stats.total << "%)" << endl
+            << " Ignored 0 Order   = " << stats.zeroorder << " (" << stats.zeroorder * 100.0 / stats.total << "%)" << endl
+            << " Ignored Not Found = " << stats.ignore << " (" << stats.ignore * 100.0 / stats.total << "%)" << endl
+            << " Malformed         = " << stats.malformed << " (" << stats.malformed * 100.0 / stats.total << "%)" << endl;
+
+    cout << "Stats (order Synchronization)" << endl
+            << " Total Initial   = " << stats.total_pre << endl
+            << " Passed          = " << stats.pass << endl
+            << " Updated         = " << stats.update << endl
+            << " Inserted    (+) = " << stats.insert << endl
+            << " Deleted     (-) = " << stats.del << endl
+            << " Total Final     = " << stats.total_post << endl;
+    if (opts.dryrun) {
+        cout << "Dry run, nothing was written" << endl;
+    }
+
+    write_metrics(opts, metrics, false);
+    return 0;
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop_watching(int) {
+    stopping = 1;
+}
+
+// Syncs once, then again every time prosheet.DBF settles after a change,
+// until SIGINT or SIGTERM.  The connection (with its prepared statements)
+// and the item index are reused by every sync; a sync that fails is reported
+// and retried on the next change.
+// return: exit status
+int watch(pqxx::connection_base &c, const sync_options &opts, itemCache &items, syncMetrics &metrics, int debounce) {
+    // The directory is watched rather than the file, as FoxPro and copies
+    // from elsewhere may replace prosheet.DBF instead of writing into it
+    size_t slash = opts.dbffile.rfind('/');
+    string dir = slash == string::npos ? "." : opts.dbffile.substr(0, slash + 1);
+    string name = slash == string::npos ? opts.dbffile : opts.dbffile.substr(slash + 1);
+    char inotifybuf[sizeof (struct inotify_event) + NAME_MAX + 1] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE) < 0) {
+        cerr << "Can't watch " << dir << ": " << strerror(errno) << endl;
+        if (fd >= 0) {
+            ::close(fd);
+        }
         return 1;
     }
 
+    signal(SIGINT, stop_watching);
+    signal(SIGTERM, stop_watching);
+
+    bool pending = true; // prosheet.DBF changed since the last sync
+    while (!stopping) {
+        if (pending) {
+            pending = false;
+            try {
+                sync_once(c, opts, items, metrics);
+            } catch (const pqxx::pqxx_exception &e) {
+                cerr << "pqxx_exception: " << e.base().what() << endl;
+                write_metrics(opts, metrics, true);
+            } catch (const std::exception &e) {
+                cerr << "exception: " << e.what() << endl;
+                write_metrics(opts, metrics, true);
+            }
+            metrics = syncMetrics(); // Each sync reports its own
+        }
+
+        // Wait for a change, then for debounce ms without one
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        bool changed = false;
+        while (!stopping) {
+            int ready = poll(&pfd, 1, changed ? debounce : -1);
+
+            if (ready < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                cerr << "poll: " << strerror(errno) << endl;
+                stopping = 1;
+                break;
+            }
+            if (ready == 0) {
+                break; // settled
+            }
+
+            ssize_t len = read(fd, inotifybuf, sizeof (inotifybuf));
+            for (ssize_t pos = 0; pos < len;) {
+                const struct inotify_event *event = (const struct inotify_event *) (inotifybuf + pos);
+
+                if (event->len > 0 && name == event->name) {
+                    changed = true;
+                }
+                pos += sizeof (struct inotify_event) + event->len;
+            }
+        }
+        pending = changed;
+    }
+
+    ::close(fd);
     return 0;
 }
 
-// Synchronization
-// return: -1 if new insert, 0+ for number of updates (0 means found without update, ie pass)
-int sync(pqxx::work &txn, map<string, order_content> &m, order_content ord) {
-    //        c.prepare("add", "INSERT INTO \"production:order_content\" (date, customer, orderno, item_id, quantity, quota) VALUES ($1, $2, $3, $4, $5, $6)");
-    //        c.prepare("update_date", "UPDATE \"production:order_content\" SET date=$1 WHERE id=$2");
-    //        c.prepare("update_customer", "UPDATE \"production:order_content\" SET customer=$1 WHERE id=$2");
-    //        c.prepare("update_orderno", "UPDATE \"production:order_content\" SET orderno=$1 WHERE id=$2");
-    //        c.prepare("update_item_id", "UPDATE \"production:order_content\" SET item_id=$1 WHERE id=$2");
-    //        c.prepare("update_quantity", "UPDATE \"production:order_content\" SET quantity=$1 WHERE id=$2");
-    //        c.prepare("update_quota", "UPDATE \"production:order_content\" SET quota=$1 WHERE id=$2");
+// Reports a change, and applies it through writer unless that is NULL (dry run)
+void apply_change(const stringPool &strings, orderWriter *writer, const order_change &change) {
+    switch (change.op) {
+        case CHANGE_INSERT:
+        {
+            log_event *e = events.raise(LOG_INSERT);
+
+            if (e != NULL) {
+                e->next() = change.after.barcode_id;
+                e->next() = strings.str(change.after.customer);
+                e->next() = strings.str(change.after.orderno);
+                e->next() = to_string(change.after.item_id);
+                events.commit();
+            }
+            if (writer != NULL) {
+                writer->insert(change.after);
+            }
+            break;
+        }
+        case CHANGE_UPDATE:
+            report_update(strings, change.before, change.after, change.columns);
+            if (writer != NULL) {
+                writer->update(change.id, change.after, change.columns);
+            }
+            break;
+        case CHANGE_DELETE:
+        {
+            log_event *e = events.raise(LOG_DELETE, change.id);
+
+            if (e != NULL) {
+                e->next() = change.before.barcode_id;
+                events.commit();
+            }
+            if (writer != NULL) {
+                writer->remove(change.id, change.before.barcode_id);
+            }
+            break;
+        }
+        case CHANGE_NONE:
+            break;
+    }
+}
+
+// Selects the rows of a batch of prosheet.DBF records worth scanning: not
+// deleted, with both quantities and the order date, and not excluded by the
+// flags.  The deletion marker and the pantychk/yconly flags are single bytes
+// tested by the SIMD prefilter; the other filter columns are only projected
+// for the rows it leaves, and checked in a branch free loop over them.  Only
+// an incremental sync looks rows up one by one.
+void select_rows(dbfReader &reader, const dbfBoundField *ps, const dbfBatch &batch, barcode_set *changed, prosheet_columns &cols) {
+    const dbfBoundField flags[2] = { ps[PS_PANTYCHK], ps[PS_YCONLY] };
+    vector<uint32_t> &selection = cols.selection;
+
+    reader.getSurvivors(batch, flags, 2, cols.survivors);
+
+    // Selection vector from the bitmap
+    selection.clear();
+    for (size_t w = 0; w < cols.survivors.size(); w++) {
+        for (uint64_t bits = cols.survivors[w]; bits != 0; bits &= bits - 1) {
+            selection.push_back(w * 64 + __builtin_ctzll(bits));
+        }
+    }
+
+    reader.getBlank(batch, ps[PS_KNIPROD], selection, cols.kniprodBlank);
+    reader.getDates(batch, ps[PS_ORDDATE], selection, cols.orddate);
+    reader.getDates(batch, ps[PS_EXFDATE], selection, cols.exfdate);
+    reader.getIntegers(batch, ps[PS_ORDERQTY], selection, cols.orderqty);
+    reader.getIntegers(batch, ps[PS_QUOTAQTY], selection, cols.quotaqty);
+    reader.getFlags(batch, ps[PS_CLOSECHK], selection, cols.closechk);
+
+    const uint8_t *kniprodBlank = cols.kniprodBlank.data();
+    const uint8_t *orddateState = cols.orddate.states.data();
+    const uint8_t *orderqtyState = cols.orderqty.states.data();
+    const uint8_t *quotaqtyState = cols.quotaqty.states.data();
+    const uint8_t *closechk = cols.closechk.data();
+
+    size_t selected = 0;
+    for (size_t s = 0; s < selection.size(); s++) {
+        uint32_t i = selection[s];
+
+        selection[selected] = i;
+        selected += (orderqtyState[i] != DBFVALUE_BLANK) & (quotaqtyState[i] != DBFVALUE_BLANK) & (orddateState[i] != DBFVALUE_BLANK) &
+                !(closechk[i] & kniprodBlank[i]);
+    }
+    selection.resize(selected);
+
+    if (changed != NULL) {
+        selected = 0;
+        for (size_t s = 0; s < selection.size(); s++) {
+            reader.useRow(batch, selection[s]);
+            dbfSlice barcode_id = reader.getSlice(ps[PS_BARCODE_ID]);
+
+            if (changed->find(&barcode_id) != NULL) {
+                selection[selected++] = selection[s];
+            }
+        }
+        selection.resize(selected);
+    }
+}
+
+// Decodes the rest of a selected row and looks its item up
+void classify_row(dbfReader &reader, const dbfBoundField *ps, const dbfBatch &batch, const prosheet_columns &cols, size_t i,
+        itemIndex &items, prosheet_row &row) {
+    reader.useRow(batch, i);
+
+    dbfSlice barcode_id = reader.getSlice(ps[PS_BARCODE_ID]);
+
+    // Report malformed values, and leave the DB row (if any) as it is
+    if (cols.orderqty.states[i] == DBFVALUE_BAD || cols.quotaqty.states[i] == DBFVALUE_BAD ||
+            cols.orddate.states[i] == DBFVALUE_BAD || cols.exfdate.states[i] == DBFVALUE_BAD) {
+        row.kind = ROW_MALFORMED;
+        row.details.resize(5);
+        barcode_id.assignTo(row.details[0]);
+        reader.getSlice(ps[PS_ORDDATE]).assignTo(row.details[1]);
+        reader.getSlice(ps[PS_EXFDATE]).assignTo(row.details[2]);
+        reader.getSlice(ps[PS_ORDERQTY]).assignTo(row.details[3]);
+        reader.getSlice(ps[PS_QUOTAQTY]).assignTo(row.details[4]);
+        barcode_id.assignTo(row.ord.barcode_id);
+        return;
+    }
+
+    // Find item id
+    dbfSlice artcono = reader.getSlice(ps[PS_ARTCONO]);
+    dbfSlice colorway = reader.getSlice(ps[PS_COLORWAY]);
+    dbfSlice size = reader.getSlice(ps[PS_SIZE]);
+
+    dbfSlice itemKey[3] = { artcono, colorway, size };
+    item_match match;
+    int item = items.find(itemKey, match);
+    row.kind = match == ITEM_NORMALIZED ? ROW_GUESS : ROW_FOUND;
+
+    if (item == 0) {
+        int64_t orderqtyFixed = 0;
+        reader.getDecimal(ps[PS_ORDERQTY], orderqtyFixed);
+        if (orderqtyFixed != 0 /* && orderqty != "" */) {
+            if (!cols.kniprodBlank[i]) { // kniprod
+                row.kind = ROW_NOT_FOUND;
+                row.details.resize(7);
+                reader.getSlice(ps[PS_ORDDATE]).assignTo(row.details[0]);
+                artcono.assignTo(row.details[1]);
+                reader.getSlice(ps[PS_ARTICLE].index).assignTo(row.details[2]);
+                colorway.assignTo(row.details[3]);
+                size.assignTo(row.details[4]);
+                reader.getSlice(ps[PS_ORDERQTY]).assignTo(row.details[5]);
+                reader.getSlice(ps[PS_KNIPROD]).assignTo(row.details[6]);
+            } else {
+                row.kind = ROW_ZERO_PRODUCTION;
+            }
+        } else {
+            row.kind = ROW_ZERO_ORDER;
+        }
+        return;
+    }
+
+    // should be synced
+    reader.getSlice(ps[PS_CUSTVAR]).assignTo(row.customer);
+    row.ord.date = cols.orddate.values[i];
+    row.ord.item_id = item;
+    reader.getSlice(ps[PS_ORDERNO]).assignTo(row.orderno);
+    row.ord.quantity = cols.orderqty.values[i];
+    row.ord.quota = cols.quotaqty.values[i];
+    barcode_id.assignTo(row.ord.barcode_id);
+    row.ord.exfdate = cols.exfdate.states[i] == DBFVALUE_OK ? cols.exfdate.values[i] : 0;
+}
+
+// Decodes, filters and looks up the current prosheet.DBF record, as a
+// batch of one
+// return: false if the row is skipped without being counted
+bool scan_row(dbfReader &reader, const dbfBoundField *ps, itemIndex &items, prosheet_columns &cols, prosheet_row &row) {
+    dbfBatch batch;
+
+    reader.currentBatch(batch);
+    select_rows(reader, ps, batch, NULL, cols);
+    if (cols.selection.empty()) {
+        return false;
+    }
+
+    classify_row(reader, ps, batch, cols, 0, items, row);
+    return true;
+}
+
+void tally_change(const order_change &change, sync_stats &stats) {
+    switch (change.op) {
+        case CHANGE_INSERT:
+            stats.insert++;
+            break;
+        case CHANGE_UPDATE:
+            stats.update++;
+            break;
+        case CHANGE_DELETE:
+            stats.del++;
+            break;
+        case CHANGE_NONE:
+            stats.pass++;
+            break;
+    }
+}
 
-    auto itr = m.find(ord.barcode_id);
-    order_content ordm;
-    int rtn = 0;
+// Reports and counts a scanned row
+// return: true if the row takes part in the reconciliation (found, guessed or malformed)
+bool count_row(const prosheet_row &row, sync_stats &stats) {
+    stats.total++;
+
+    switch (row.kind) {
+        case ROW_MALFORMED:
+            report_row(LOG_MALFORMED, row.details);
+            stats.malformed++;
+            return true;
+        case ROW_NOT_FOUND:
+            report_row(LOG_NOT_FOUND, row.details);
+            stats.ignore++;
+            return false;
+        case ROW_ZERO_PRODUCTION:
+            stats.zeroproduction++;
+            return false;
+        case ROW_ZERO_ORDER:
+            stats.zeroorder++;
+            return false;
+        case ROW_FOUND:
+            stats.found++;
+            return true;
+        case ROW_GUESS:
+            stats.guess++;
+            return true;
+    }
 
-    if (itr != m.end()) {
-        ordm = itr->second;
+    return false;
+}
 
-        if (ordm.date != ord.date) {
-            cout << " UPDATE " << itr->first << " date at " << ordm.id << " : " << ordm.date << " -> " << ord.date << endl;
-            txn.prepared("update_date")(ord.date)(ordm.id).exec();
-	        rtn++;
+// Points a scanned row's ord at its customer and orderno in strings
+void intern_row(stringPool &strings, prosheet_row &row) {
+    if (row.kind == ROW_FOUND || row.kind == ROW_GUESS) {
+        row.ord.customer = strings.intern(row.customer);
+        row.ord.orderno = strings.intern(row.orderno);
+    }
+}
+
+// Applies a scanned row to the sync, or sets it aside for the merge-join or
+// the server join; rows must arrive in prosheet.DBF order
+void merge_row(prosheet_row &row, stringPool &strings, orderDiff &diff, orderSink *aside, orderWriter *writer, sync_stats &stats) {
+    order_change change;
+
+    if (!count_row(row, stats)) {
+        return;
+    }
+    intern_row(strings, row);
+
+    if (aside != NULL) {
+        aside->add(row.ord, row.kind == ROW_MALFORMED);
+    } else if (row.kind == ROW_MALFORMED) {
+        // Leave the DB row (if any) as it is
+        diff.keep(row.ord.barcode_id);
+    } else {
+        // if current row is in orderMap, check each item. if diff, update. remove from orderMap
+        // if not in orderMap, insert into DB.
+        diff.diff(row.ord, change);
+        apply_change(strings, writer, change);
+        tally_change(change, stats);
+    }
+}
+
+// Chunks scanned by the worker threads, waiting to be merged in file order
+struct scan_queue {
+    mutex lock;
+    condition_variable changed;
+    vector<vector<prosheet_row> > chunks;
+    vector<bool> ready;
+    size_t merged; // chunks handed to the merge so far
+    size_t lookahead; // chunks a worker may get ahead of the merge
+    bool aborted; // the merge failed, workers stop at the next chunk
+    uint64_t decodewall; // wall time the workers spent scanning, in ns
+};
+
+// Scans every threads-th chunk of prosheet.DBF, starting at chunk first, on
+// its own reader; the item index is only read
+void scan_worker(const string &dbffile, bool mapped, size_t first, size_t step, unsigned int recordcount, barcode_set *changed,
+        itemIndex &items, scan_queue &queue) {
+    dbfReader reader;
+    dbfBoundField ps[PS_FIELDCOUNT];
+    string layoutError;
+    dbfBatch batch;
+    prosheet_columns cols;
+    prosheet_row row;
+
+    reader.open(dbffile, mapped);
+    reader.bind(prosheetSchema, PS_FIELDCOUNT, ps, layoutError); // already checked by main
+
+    for (size_t chunk = first; chunk < queue.chunks.size(); chunk += step) {
+        vector<prosheet_row> rows;
+
+        {
+            unique_lock<mutex> hold(queue.lock);
+            while (chunk >= queue.merged + queue.lookahead && !queue.aborted) {
+                queue.changed.wait(hold);
+            }
+            if (queue.aborted) {
+                break;
+            }
+        }
+
+        uint64_t started = syncMetrics::wallNow();
+        reader.setRange(chunk * SCANCHUNK, min<size_t>((chunk + 1) * SCANCHUNK, recordcount));
+        while (reader.nextBatch(batch)) {
+            select_rows(reader, ps, batch, changed, cols);
+            for (size_t s = 0; s < cols.selection.size(); s++) {
+                classify_row(reader, ps, batch, cols, cols.selection[s], items, row);
+                rows.push_back(row);
+            }
         }
 
-        if (ordm.customer != ord.customer) {
-            cout << " UPDATE " << itr->first << " customer at " << ordm.id << " : " << ordm.customer << " -> " << ord.customer << endl;
-            txn.prepared("update_customer")(ord.customer)(ordm.id).exec();
-	        rtn++;
+        lock_guard<mutex> hold(queue.lock);
+        queue.decodewall += syncMetrics::wallNow() - started;
+        queue.chunks[chunk].swap(rows);
+        queue.ready[chunk] = true;
+        queue.changed.notify_all();
+    }
+
+    reader.close();
+}
+
+// Scans prosheet.DBF in SCANCHUNK record chunks on worker threads and merges
+// the chunks in file order, so the writes and the report come out exactly as
+// in a single threaded run
+void scan_parallel(const string &dbffile, bool mapped, int threads, unsigned int recordcount, barcode_set *changed,
+        itemIndex &items, stringPool &strings, orderDiff &diff, orderSink *aside, orderWriter *writer, sync_stats &stats,
+        syncMetrics *metrics) {
+    scan_queue queue;
+    size_t chunkcount = (recordcount + SCANCHUNK - 1) / SCANCHUNK;
+    vector<thread> workers;
+
+    queue.chunks.resize(chunkcount);
+    queue.ready.resize(chunkcount, false);
+    queue.merged = 0;
+    queue.lookahead = threads * 2;
+    queue.aborted = false;
+    queue.decodewall = 0;
+    uint64_t reconcileWall = 0;
+
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread(scan_worker, cref(dbffile), mapped, t, threads, recordcount, changed,
+                ref(items), ref(queue)));
+    }
+
+    // A failed write (or spill, or COPY) must not leave the workers joinable
+    // or waiting for a merge that is gone
+    try {
+        for (size_t chunk = 0; chunk < chunkcount; chunk++) {
+            vector<prosheet_row> rows;
+
+            {
+                unique_lock<mutex> hold(queue.lock);
+                while (!queue.ready[chunk]) {
+                    queue.changed.wait(hold);
+                }
+                rows.swap(queue.chunks[chunk]);
+                queue.merged++;
+                queue.changed.notify_all();
+            }
+
+            uint64_t started = syncMetrics::wallNow();
+            for (size_t i = 0; i < rows.size(); i++) {
+                merge_row(rows[i], strings, diff, aside, writer, stats);
+            }
+            reconcileWall += syncMetrics::wallNow() - started;
+        }
+    } catch (...) {
+        {
+            lock_guard<mutex> hold(queue.lock);
+            queue.aborted = true;
+            queue.changed.notify_all();
+        }
+        for (size_t t = 0; t < workers.size(); t++) {
+            workers[t].join();
         }
+        throw;
+    }
+
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+
+    if (metrics != NULL) {
+        metrics->addStage("decode", queue.decodewall, 0, recordcount);
+        metrics->addStage("reconcile", reconcileWall, 0, stats.total);
+    }
+}
+
+// Streams production:order_content ordered by barcode_id (bytewise, as
+// the prosheet rows come) and merges it with the rows in one pass.  Within a barcode the first prosheet row takes the DB row, as
+// with the map: a malformed one leaves it alone, any later row is inserted,
+// and a DB row no prosheet row takes is deleted.  Like the map, only the
+// first DB row of a barcode (lowest id) is reconciled.
+// return: the barcodes in production:order_content
+int merge_join(pqxx::work &txn, const sorted_rows &rows, stringPool &strings, orderWriter *writer, sync_stats &stats) {
+    pqxx::icursorstream cur(txn, "SELECT id, date, customer, orderno, item_id, quantity, quota, barcode_id, exfdate FROM \"production:order_content\" "
+            "ORDER BY barcode_id COLLATE \"C\", id", "order_content_join", MAPLOADBATCH);
+    pqxx::result r;
+    pqxx::result::size_type i = 0;
+    order_content db;
+    sorted_row row;
+    order_change change;
+    string barcode_id;
+    int dbrows = 0;
 
-        if (ordm.orderno != ord.orderno) {
-            cout << " UPDATE " << itr->first << " orderno at " << ordm.id << " : " << ordm.orderno << " -> " << ord.orderno << endl;
-            txn.prepared("update_orderno")(ord.orderno)(ordm.id).exec();
-	        rtn++;
+    // The next DB row, fetching MAPLOADBATCH at a time
+    auto nextDb = [&]() {
+        while (i == r.size()) {
+            if (!(cur >> r)) {
+                return false;
+            }
+            i = 0;
+        }
+        read_order_content(r, i++, strings, db);
+        return true;
+    };
+
+    bool haveDb = nextDb();
+    bool haveRow = rows(row);
+
+    while (haveDb || haveRow) {
+        bool matched = false;
+        order_content found;
+
+        if (haveDb && (!haveRow || db.barcode_id <= row.ord.barcode_id)) {
+            barcode_id = db.barcode_id;
+            found = db;
+            matched = true;
+            dbrows++;
+            do {
+                haveDb = nextDb();
+            } while (haveDb && db.barcode_id == barcode_id); // only the first DB row is reconciled
+        } else {
+            barcode_id = row.ord.barcode_id;
         }
 
-        if (ordm.item_id != ord.item_id) {
-            cout << " UPDATE " << itr->first << " item_id at " << ordm.id << " : " << ordm.item_id << " -> " << ord.item_id << endl;
-            txn.prepared("update_item_id")(ord.item_id)(ordm.id).exec();
-	        rtn++;
+        for (; haveRow && row.ord.barcode_id == barcode_id; haveRow = rows(row)) {
+            if (!row.keep) {
+                orderDiff::match(matched ? &found : NULL, row.ord, change);
+                apply_change(strings, writer, change);
+                tally_change(change, stats);
+            }
+            matched = false;
         }
 
-        if (ordm.quantity != ord.quantity) {
-            cout << " UPDATE " << itr->first << " quantity at " << ordm.id << " : " << ordm.quantity << " -> " << ord.quantity << endl;
-            txn.prepared("update_quantity")(ord.quantity)(ordm.id).exec();
-	        rtn++;
+        if (matched) {
+            orderDiff::removal(found, change);
+            apply_change(strings, writer, change);
+            tally_change(change, stats);
         }
+    }
+
+    return dbrows;
+}
+
+// Reconciles the rows an orderStage left in ordersync_rows with
+// production:order_content on the server, deciding as merge_join does: the
+// first staged row of a barcode takes its first DB row (lowest id), where a
+// malformed one leaves it alone, any later row is inserted, and a DB row no
+// staged row takes is deleted.  The pairing is planned into ordersync_plan
+// with one join; only the changes come back, to be reported (inserts and
+// updates in prosheet order, then deletes in barcode order), and they are
+// applied with one UPDATE, one INSERT and one DELETE, whose row counts are
+// the ones in the stats.
+// return: the barcodes in production:order_content
+int server_join(pqxx::work &txn, stringPool &strings, syncMetrics *metrics, sync_stats &stats) {
+    static const char *const values = "date, customer, orderno, item_id, quantity, quota, barcode_id, exfdate";
+    ostringstream plan;
+
+    // op: I(nsert), U(pdate), D(elete), P(ass), or K(eep) for a malformed row
+    plan << "CREATE TEMP TABLE ordersync_plan ON COMMIT DROP AS "
+            "SELECT p.*, CASE WHEN p.seq IS NULL THEN 'D' WHEN p.keep THEN 'K' WHEN p.id IS NULL THEN 'I' "
+            "WHEN p.columns <> 0 THEN 'U' ELSE 'P' END AS op FROM (SELECT s.seq, s.keep, d.id, ";
+    for (int column = 0; column < OC_COLUMNCOUNT; column++) {
+        plan << (column > 0 ? " + " : "") << "CASE WHEN s." << order_column_names[column] << " IS DISTINCT FROM d."
+                << order_column_names[column] << " THEN " << OC_BIT(column) << " ELSE 0 END";
+    }
+    plan << " AS columns, s.date, s.customer, s.orderno, s.item_id, s.quantity, s.quota, "
+            "coalesce(s.barcode_id, d.barcode_id) AS barcode_id, s.exfdate, ";
+    for (int column = 0; column < OC_COLUMNCOUNT; column++) {
+        plan << "d." << order_column_names[column] << " AS db_" << order_column_names[column] << ", ";
+    }
+    // The join conditions are both equalities, as a FULL JOIN needs
+    plan << "d.barcode_id AS db_barcode_id "
+            "FROM (SELECT *, row_number() OVER (PARTITION BY barcode_id ORDER BY seq) AS n FROM ordersync_rows) s "
+            "FULL JOIN (SELECT DISTINCT ON (barcode_id) *, 1::bigint AS n FROM \"production:order_content\" ORDER BY barcode_id, id) d "
+            "ON s.barcode_id = d.barcode_id AND s.n = d.n) p";
+
+    {
+        latencyTimer timer(metrics, "server_plan");
+        txn.exec(plan.str());
+        txn.exec("ANALYZE ordersync_plan");
+    }
+
+    int dbrows = 0;
+    {
+        latencyTimer timer(metrics, "server_count");
+        pqxx::result r = txn.exec("SELECT op, count(*), count(id) FROM ordersync_plan GROUP BY op");
+
+        for (pqxx::result::size_type i = 0; i != r.size(); ++i) {
+            int rows;
+            int matched;
 
-        if (ordm.quota != ord.quota) {
-            cout << " UPDATE " << itr->first << " quota at " << ordm.id << " : " << ordm.quota << " -> " << ord.quota << endl;
-            txn.prepared("update_quota")(ord.quota)(ordm.id).exec();
-	        rtn++;
+            r[i][1].to(rows);
+            r[i][2].to(matched);
+            if (string(r[i][0].c_str()) == "P") {
+                stats.pass = rows;
+            }
+            dbrows += matched;
         }
+    }
 
-        if (ordm.exfdate != ord.exfdate) {
-            cout << " UPDATE " << itr->first << " exfdate at " << ordm.id << " : " << ordm.exfdate << " -> " << ord.exfdate << endl;
-            txn.prepared("update_exfdate")(ord.exfdate)(ordm.id).exec();
-	        rtn++;
+    // Each change as two order_content rows in read_order_content's layout,
+    // the prosheet row from column 2 and the DB row from column 11
+    {
+        latencyTimer timer(metrics, "server_report");
+        pqxx::icursorstream cur(txn, "SELECT op, columns, id, date, customer, orderno, item_id, quantity, quota, barcode_id, exfdate, "
+                "id, db_date, db_customer, db_orderno, db_item_id, db_quantity, db_quota, db_barcode_id, db_exfdate "
+                "FROM ordersync_plan WHERE op IN ('I', 'U', 'D') ORDER BY op = 'D', seq, barcode_id", "order_content_plan", MAPLOADBATCH);
+        pqxx::result r;
+
+        while (cur >> r) {
+            for (pqxx::result::size_type i = 0; i != r.size(); ++i) {
+                order_change change;
+                char op = r[i][0].c_str()[0];
+
+                change.before = order_content();
+                change.after = order_content();
+                change.columns = 0;
+                change.op = op == 'I' ? CHANGE_INSERT : op == 'U' ? CHANGE_UPDATE : CHANGE_DELETE;
+                r[i][1].to(change.columns);
+                read_order_content(r, i, strings, change.after, 2);
+                read_order_content(r, i, strings, change.before, 11);
+                change.id = change.before.id;
+
+                apply_change(strings, NULL, change);
+            }
         }
+    }
 
-        m.erase(itr);
-    } else {
-        cout << " NOT FOUND: INSERT " << getKey(ord) << endl;
-        txn.prepared("add")(ord.date)(ord.customer)(ord.orderno)(ord.item_id)(ord.quantity)(ord.quota)(ord.barcode_id)(ord.exfdate).exec();
-	    rtn = -1;
+    {
+        latencyTimer timer(metrics, "server_update");
+        ostringstream sql;
+
+        sql << "UPDATE \"production:order_content\" oc SET ";
+        for (int column = 0; column < OC_COLUMNCOUNT; column++) {
+            sql << (column > 0 ? ", " : "") << order_column_names[column] << " = p." << order_column_names[column];
+        }
+        sql << " FROM ordersync_plan p WHERE p.op = 'U' AND oc.id = p.id";
+        stats.update = txn.exec(sql.str()).affected_rows();
+    }
+    {
+        latencyTimer timer(metrics, "server_insert");
+        stats.insert = txn.exec(string("INSERT INTO \"production:order_content\" (") + values + ") "
+                "SELECT " + values + " FROM ordersync_plan WHERE op = 'I' ORDER BY seq").affected_rows();
+    }
+    {
+        latencyTimer timer(metrics, "server_delete");
+        stats.del = txn.exec("DELETE FROM \"production:order_content\" oc USING ordersync_plan p "
+                "WHERE p.op = 'D' AND oc.id = p.id").affected_rows();
     }
 
-    return rtn;
+    return dbrows;
 }
 
+// Opens the BARCODE_ID tag of filename, making sure it is a plain index
+// on barcode_id that covers every record of prosheet.DBF, so a stale or
+// filtered index fails the sync before anything is written
+void open_index(cdxReader &index, const string &filename, unsigned int recordcount) {
+    vector<string> tags;
+    string error;
+    unsigned int entries = 0;
+
+    index.open(filename);
+    tags = index.tagNames();
+    if (!index.selectTag(tags.size() == 1 && tags[0].empty() ? "" : "BARCODE_ID", error)) {
+        throw runtime_error(filename + ": " + error);
+    }
+    if (strcasecmp(trim(index.keyExpression()).c_str(), "BARCODE_ID") != 0 || !index.forExpression().empty()) {
+        throw runtime_error(filename + ": not a plain index on barcode_id");
+    }
+
+    index.first();
+    while (index.next()) {
+        entries++;
+    }
+    if (entries != recordcount) {
+        throw runtime_error(filename + " doesn't match prosheet.DBF, reindex it");
+    }
+    index.first();
+}
+
+// Feeds merge_join straight from prosheet.DBF, walked in index order and
+// reported and counted as a scan would; the order is checked on the way,
+// as the join depends on it (a collation other than machine would break it)
+bool next_indexed_row(cdxReader &index, dbfReader &reader, const dbfBoundField *ps, itemIndex &items, stringPool &strings,
+        prosheet_columns &cols, sync_stats &stats, sorted_row &sorted) {
+    prosheet_row row;
+
+    while (index.next()) {
+        if (!reader.go(index.record())) {
+            throw runtime_error("index points past the end of prosheet.DBF");
+        }
+        if (!scan_row(reader, ps, items, cols, row) || !count_row(row, stats)) {
+            continue;
+        }
+        // sorted still holds the row before, if any
+        if (stats.found + stats.guess + stats.malformed > 1 && row.ord.barcode_id < sorted.ord.barcode_id) {
+            throw runtime_error("index is not in barcode order, reindex it with SET COLLATE TO \"MACHINE\"");
+        }
+
+        intern_row(strings, row);
+        sorted.seq = index.record();
+        sorted.keep = row.kind == ROW_MALFORMED;
+        sorted.ord = row.ord;
+        return true;
+    }
+
+    return false;
+}
+
+// Hashes every prosheet.DBF record into snapshot, grouped by barcode_id
+void take_snapshot(dbfReader &reader, const dbfBoundField *ps, syncSnapshot &snapshot) {
+    while (reader.next()) {
+        snapshot.add(reader.getSlice(ps[PS_BARCODE_ID]), reader.getRecord());
+    }
+    reader.reset();
+}
+
+// Collects the barcodes whose records differ between the two snapshots,
+// those gone from prosheet.DBF included, into changed and barcodes
+// return: the number of records left as they were
+int snapshot_changes(syncSnapshot &previous, syncSnapshot &current, barcode_set &changed, vector<string> &barcodes) {
+    int unchanged = 0;
+
+    for (syncSnapshot::group_index::iterator itr = current.groups.begin(); itr != current.groups.end(); ++itr) {
+        dbfSlice key[1] = { itr.key(0) };
+        snapshot_group *before = previous.groups.find(key);
+
+        if (before != NULL && *before == itr.value()) {
+            unchanged += itr.value().count;
+        } else {
+            changed.set(key, true);
+            barcodes.push_back(key[0].str());
+        }
+    }
+
+    for (syncSnapshot::group_index::iterator itr = previous.groups.begin(); itr != previous.groups.end(); ++itr) {
+        dbfSlice key[1] = { itr.key(0) };
+
+        if (current.groups.find(key) == NULL) {
+            barcodes.push_back(key[0].str());
+        }
+    }
+
+    return unchanged;
+}
+
+// Row count and xmin sum of production:order_content; xmin is the writing
+// transaction of a row version, so any insert, update or delete moves one
+// of them
+void fingerprint_order_content(pqxx::work &txn, uint32_t &rowcount, int64_t &xminsum) {
+    pqxx::result r = txn.exec("SELECT count(*), coalesce(sum(xmin::text::bigint), 0) FROM \"production:order_content\"");
+
+    rowcount = 0;
+    xminsum = 0;
+    r[0][0].to(rowcount);
+    r[0][1].to(xminsum);
+}
+
+// The reference maps are streamed through server-side cursors, MAPLOADBATCH
+// rows at a time, and built as the rows arrive; columns are read by position
+// in the order of each SELECT list.
 void generate_order_map(pqxx::work &txn, map<string, order> &m, set<string> &s) {
-    pqxx::result r = txn.exec("SELECT * FROM \"production:order\"");
-    
-    for (auto i = 0 ; i != r.size() ; ++i) {
-        order tmp;
-        
-        r[i]["id"].to(tmp.id);
-        r[i]["name"].to(tmp.name);
-        r[i]["customer"].to(tmp.customer);
-        r[i]["date"].to(tmp.date);
-        
-        m[tmp.name] = tmp;
-        s.insert(tmp.name);
+    pqxx::icursorstream cur(txn, "SELECT id, name, customer, date FROM \"production:order\"", "order_map", MAPLOADBATCH);
+    pqxx::result r;
+
+    while (cur >> r) {
+        for (pqxx::result::size_type i = 0; i != r.size(); ++i) {
+            order tmp;
+
+            r[i][0].to(tmp.id);
+            r[i][1].to(tmp.name);
+            r[i][2].to(tmp.customer);
+            r[i][3].to(tmp.date);
+
+            m[tmp.name] = tmp;
+            s.insert(tmp.name);
+        }
     }
 }
 
-void generate_order_content_map(pqxx::work &txn, map<string, order_content> &m, set<string> &s) {
-    pqxx::result r = txn.exec("SELECT * FROM \"production:order_content\"");
-    string barcode_id;
+// barcode_id is not unique (a sync inserts every prosheet row after the
+// first of a barcode), so rows come in id order and only the first of each
+// barcode is kept: the lowest id, which the joins reconcile as well
+void generate_order_content_map(pqxx::work &txn, stringPool &strings, order_content_index &m, set<string> &s, const string &where) {
+    pqxx::icursorstream cur(txn, "SELECT id, date, customer, orderno, item_id, quantity, quota, barcode_id, exfdate FROM \"production:order_content\"" + where +
+            " ORDER BY id", "order_content_map", MAPLOADBATCH);
+    pqxx::result r;
 
-    for (auto i = 0; i != r.size(); ++i) {
-        order_content tmp;
+    while (cur >> r) {
+        for (pqxx::result::size_type i = 0; i != r.size(); ++i) {
+            order_content tmp;
 
-        r[i]["id"].to(tmp.id);
-        r[i]["date"].to(tmp.date);
-        r[i]["customer"].to(tmp.customer);
-        r[i]["orderno"].to(tmp.orderno);
-        r[i]["item_id"].to(tmp.item_id);
-        r[i]["quantity"].to(tmp.quantity);
-        r[i]["quota"].to(tmp.quota);
-        r[i]["barcode_id"].to(barcode_id);
-        r[i]["exfdate"].to(tmp.exfdate);
+            read_order_content(r, i, strings, tmp);
 
-        m[barcode_id] = tmp;
-        s.insert(barcode_id);
+            dbfSlice key[1] = { stringSlice(tmp.barcode_id) };
+            if (m.find(key) != NULL) {
+                continue;
+            }
+            m.set(key, tmp);
+            s.insert(tmp.barcode_id);
+        }
+    }
+}
+
+// One row of SELECT id, date, customer, orderno, item_id, quantity, quota, barcode_id, exfdate
+// (in the columns from first on), its text interned into strings straight
+// from the result (NULL reads as "")
+void read_order_content(const pqxx::result &r, pqxx::result::size_type i, stringPool &strings, order_content &ord, int first) {
+    pqxx::tuple row = r[i];
+
+    row[first].to(ord.id);
+    if (!packDate(row[first + 1].c_str(), row[first + 1].size(), ord.date) ||
+            !packDate(row[first + 8].c_str(), row[first + 8].size(), ord.exfdate)) {
+        throw runtime_error(string("unexpected date in production:order_content: ") + row[first + 1].c_str() + ", " + row[first + 8].c_str());
     }
+    ord.customer = strings.intern(row[first + 2].c_str(), row[first + 2].size());
+    ord.orderno = strings.intern(row[first + 3].c_str(), row[first + 3].size());
+    row[first + 4].to(ord.item_id);
+    row[first + 5].to(ord.quantity);
+    row[first + 6].to(ord.quota);
+    row[first + 7].to(ord.barcode_id);
 }
 
-void generate_item_map(pqxx::work &txn, map<string, int> &m, map<string, int> &m_trim) {
-    pqxx::result r = txn.exec("SELECT \"sock:item\".item_id, \"sock:article\".artcono, \"sock:color\".name as color, \"sock:size\".name as size FROM \"sock:article\", \"sock:color\", \"sock:size\", \"sock:item\" WHERE \"sock:item\".article_id = \"sock:article\".article_id AND \"sock:item\".color_id = \"sock:color\".color_id AND \"sock:item\".size_id = \"sock:size\".size_id");
+// Only the rows of the given barcodes, MAPLOADBATCH barcodes per query
+void generate_changed_order_content_map(pqxx::work &txn, const vector<string> &barcodes, stringPool &strings,
+        order_content_index &m, set<string> &s) {
+    for (size_t first = 0; first < barcodes.size(); first += MAPLOADBATCH) {
+        size_t end = min(first + MAPLOADBATCH, barcodes.size());
+        string where = " WHERE barcode_id IN (";
 
-    for (pqxx::result::size_type i = 0; i != r.size(); ++i) {
-        string artcono;
-        string color;
-        string size;
-        int itemId;
+        for (size_t i = first; i < end; i++) {
+            if (i > first) {
+                where += ", ";
+            }
+            where += txn.quote(barcodes[i]);
+        }
+        where += ")";
+
+        generate_order_content_map(txn, strings, m, s, where);
+    }
+}
 
-        r[i]["artcono"].to(artcono);
-        r[i]["color"].to(color);
-        r[i]["size"].to(size);
+void generate_item_map(pqxx::work &txn, itemIndex &items) {
+    pqxx::icursorstream cur(txn, "SELECT \"sock:item\".item_id, \"sock:article\".artcono, \"sock:color\".name as color, \"sock:size\".name as size FROM \"sock:article\", \"sock:color\", \"sock:size\", \"sock:item\" WHERE \"sock:item\".article_id = \"sock:article\".article_id AND \"sock:item\".color_id = \"sock:color\".color_id AND \"sock:item\".size_id = \"sock:size\".size_id", "item_map", MAPLOADBATCH);
+    pqxx::result r;
+
+    while (cur >> r) {
+        for (pqxx::result::size_type i = 0; i != r.size(); ++i) {
+            string artcono;
+            string color;
+            string size;
+            int itemId;
+
+            r[i][0].to(itemId);
+            r[i][1].to(artcono);
+            r[i][2].to(color);
+            r[i][3].to(size);
+
+            items.add(artcono, color, size, itemId);
+        }
+    }
+}
+
+// Cheap fingerprint of the tables behind the item index, without joining
+// them; it moves whenever items, articles, colors or sizes are added or
+// removed, and, through the sum of the xmins (the transaction that wrote
+// each row version), whenever one is updated
+string item_version(pqxx::work &txn) {
+    static const char *const tables[4] = { "sock:item", "sock:article", "sock:color", "sock:size" };
+    string sql = "SELECT (SELECT coalesce(max(item_id), 0) FROM \"sock:item\")";
+
+    for (int t = 0; t < 4; t++) {
+        sql += string(", (SELECT count(*) FROM \"") + tables[t] + "\"), (SELECT coalesce(sum(xmin::text::bigint), 0) FROM \"" + tables[t] + "\")";
+    }
 
-        r[i]["item_id"].to(itemId);
+    pqxx::result r = txn.exec(sql);
+    string version;
 
-        // cout << artcono << ", " << color << ", " << size << " --> " << value.art << ", " << value.col << ", " << value.siz << endl;
-        m[flatten_key(artcono, color, size)] = itemId;
-        m_trim[flatten_key(trim(artcono), trim(color), trim(size))] = itemId;
+    for (size_t i = 0; i < r[0].size(); i++) {
+        version += r[0][i].c_str();
+        version += "/";
     }
+
+    return version;
 }
 
-// trims parenthesis and all blanks
-string trim(string str) {
-    int l = 0;
-    string tmp = "";
+// (Re)builds the item index unless it is already built at the current
+// item_version(), in memory or in the item cache file
+void refresh_items(pqxx::work &txn, const sync_options &opts, itemCache &items) {
+    string version = item_version(txn);
+    string error;
+
+    if (version == items.version) {
+        return;
+    }
 
-    for (int i = 0; i < str.length(); i++) {
-        if (str[i] == '(') l++;
-        else if (str[i] == ')') l--;
-        else if (l == 0) {
-            tmp += str[i];
+    if (!opts.itemcachefile.empty()) {
+        if (items.load(opts.itemcachefile, opts.dbstring, version, error)) {
+            return;
         }
+        report_notice("ITEM CACHE REBUILT: " + error);
     }
 
-    boost::trim(tmp);
+    items.clear();
+    generate_item_map(txn, items.index);
+    items.version = version;
 
-    return tmp;
+    if (!opts.itemcachefile.empty() && !items.save(opts.itemcachefile, opts.dbstring, error)) {
+        cerr << "Item cache not saved, the next run will build the item index again: " << error << endl;
+    }
 }
 
-string flatten_key(string artcono, string color, string size) {
-    return artcono + "|||" + color + "|||" + size;
+// Writes the metrics of a sync, if asked to; a failed sync's are those of
+// the stages it got through
+void write_metrics(const sync_options &opts, syncMetrics &metrics, bool failed) {
+    string error;
+
+    if (!opts.metricsfile.empty() && !metrics.write(opts.metricsfile, opts.metricsformat, failed, error)) {
+        cerr << "Metrics not written: " << error << endl;
+    }
 }
 
-string getKey(order_content ord) {
-    return flatten_key(ord.customer, ord.orderno, to_string(ord.item_id));
+// One event per updated row, listing exactly the columns in the change mask
+void report_update(const stringPool &strings, const order_content &from, const order_content &to, unsigned int columns) {
+    log_event *e = events.raise(LOG_UPDATE, from.id);
+
+    if (e == NULL) {
+        return;
+    }
+
+    e->next() = to.barcode_id;
+    for (int column = 0; column < OC_COLUMNCOUNT; column++) {
+        if (columns & OC_BIT(column)) {
+            e->next() = order_column_names[column];
+            e->next() = order_column_value(strings, from, column);
+            e->next() = order_column_value(strings, to, column);
+        }
+    }
+    events.commit();
 }
 
-string isoDate(string date) {
-    return date.substr(0, 4) + "-" + date.substr(4, 2) + "-" + date.substr(6, 2);
+// A skipped prosheet row, with the values classify_row kept for it
+void report_row(log_category category, const vector<string> &details) {
+    log_event *e = events.raise(category);
+
+    if (e == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < details.size(); i++) {
+        e->next() = details[i];
+    }
+    events.commit();
+}
+
+void report_notice(const string &message) {
+    log_event *e = events.raise(LOG_NOTICE);
+
+    if (e != NULL) {
+        e->next() = message;
+        events.commit();
+    }
 }
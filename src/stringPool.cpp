@@ -0,0 +1,62 @@
+/*
+ * File:   stringPool.cpp
+ */
+
+#include <cstring>
+
+#include "flatHash.h"
+#include "stringPool.h"
+
+stringPool::stringPool() {
+    clear();
+}
+
+void stringPool::clear() {
+    string().swap(arena);
+    vector<uint32_t>(1, 0).swap(offsets);
+    vector<uint32_t>().swap(hashes);
+    vector<uint32_t>().swap(slots);
+    rehash(16);
+
+    intern("", 0);
+}
+
+uint32_t stringPool::intern(const char *ptr, size_t len) {
+    dbfSlice key[1] = { ptr, len };
+    uint32_t hash = (uint32_t) flatHash<uint32_t, 1>::hashKey(key);
+    size_t slot = hash & mask;
+
+    for (; slots[slot] != 0; slot = (slot + 1) & mask) {
+        uint32_t id = slots[slot] - 1;
+
+        if (hashes[id] == hash && offsets[id + 1] - offsets[id] == len && memcmp(arena.data() + offsets[id], ptr, len) == 0) {
+            return id;
+        }
+    }
+
+    uint32_t id = hashes.size();
+    arena.append(ptr, len);
+    offsets.push_back(arena.size());
+    hashes.push_back(hash);
+    slots[slot] = id + 1;
+
+    if (hashes.size() * 2 > slots.size()) {
+        rehash(slots.size() * 2);
+    }
+
+    return id;
+}
+
+void stringPool::rehash(size_t capacity) {
+    vector<uint32_t>(capacity, 0).swap(slots);
+    mask = capacity - 1;
+
+    for (uint32_t id = 0; id < hashes.size(); id++) {
+        size_t slot = hashes[id] & mask;
+
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = id + 1;
+    }
+}
@@ -0,0 +1,68 @@
+/*
+ * File:   stringPool.h
+ *
+ * Interns the text columns of order_content (customer, orderno) for the
+ * length of a sync.  Each distinct value is stored once, back to back in an
+ * append-only arena, and known by a dense id from then on, so rows repeating
+ * a value share it and comparing two values is comparing two ints.  Id 0
+ * is always "".
+ */
+
+#ifndef STRINGPOOL_H
+#define STRINGPOOL_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "dbfReader.h"
+
+using namespace std;
+
+class stringPool {
+private:
+    string arena; /* Every value, back to back */
+    vector<uint32_t> offsets; /* Start of each id's value in arena, then the end of the last */
+    vector<uint32_t> hashes; /* Of each id's value, so rehashing doesn't touch the arena */
+    vector<uint32_t> slots; /* Open addressing table of id + 1, 0 for empty */
+    size_t mask;
+
+public:
+    stringPool();
+
+    void clear();
+
+    uint32_t intern(const char *ptr, size_t len);
+
+    uint32_t intern(const string &value) {
+        return intern(value.data(), value.length());
+    }
+
+    uint32_t intern(const dbfSlice &value) {
+        return intern(value.ptr, value.len);
+    }
+
+    // The value of id; the slice is only valid until the next intern()
+    dbfSlice get(uint32_t id) const {
+        dbfSlice value = { arena.data() + offsets[id], offsets[id + 1] - offsets[id] };
+        return value;
+    }
+
+    string str(uint32_t id) const {
+        return get(id).str();
+    }
+
+    // Distinct values, "" included
+    size_t size() const {
+        return offsets.size() - 1;
+    }
+
+    size_t bytes() const {
+        return arena.size();
+    }
+
+private:
+    void rehash(size_t capacity);
+};
+
+#endif /* STRINGPOOL_H */
@@ -0,0 +1,351 @@
+/*
+ * File:   syncLog.cpp
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <time.h>
+
+#include "syncLog.h"
+#include "syncMetrics.h"
+#include "textUtil.h"
+
+// The writer writes its block out once it grows past this
+#define LOGBLOCKSIZE 65536
+
+// Lowest verbosity that writes each category
+static const int categoryLevels[LOG_CATEGORIES] = {
+    LOGNOTICES, LOGNOTICES, LOGALL, LOGALL, LOGALL, LOGALL, LOGNOTICES
+};
+
+// JSON names of the values of each category, in order (UPDATE's are pairs
+// under "changes" instead)
+static const char *const malformedNames[] = { "barcode_id", "orddate", "exfdate", "orderqty", "quotaqty", NULL };
+static const char *const notFoundNames[] = { "orddate", "artcono", "article", "colorway", "size", "orderqty", "kniprod", NULL };
+static const char *const insertNames[] = { "barcode_id", "customer", "orderno", "item_id", NULL };
+static const char *const barcodeNames[] = { "barcode_id", NULL };
+static const char *const noticeNames[] = { "message", NULL };
+static const char *const suppressedNames[] = { "category", "count", NULL };
+
+static const char *const *const valueNames[LOG_CATEGORIES] = {
+    noticeNames, malformedNames, notFoundNames, insertNames, barcodeNames, barcodeNames, suppressedNames
+};
+
+syncLog::syncLog() : ring(LOGRINGSIZE), head(0), tail(0), flushed(0), stopping(false), parked(false) {
+    out = NULL;
+    owned = false;
+    format = LOG_TEXT;
+    verbosity = LOGALL;
+    ratelimit = 0;
+    started = false;
+    window = 0;
+    memset(raised, 0, sizeof (raised));
+    memset(suppressed, 0, sizeof (suppressed));
+}
+
+syncLog::~syncLog() {
+    close();
+}
+
+const char *syncLog::categoryName(log_category category) {
+    static const char *const names[LOG_CATEGORIES] = {
+        "notice", "malformed", "not_found", "insert", "update", "delete", "suppressed"
+    };
+
+    return names[category];
+}
+
+bool syncLog::open(const string &filename, log_format format, int verbosity, unsigned int ratelimit, string &error) {
+    close();
+
+    if (filename.empty()) {
+        out = stdout;
+        owned = false;
+    } else {
+        out = fopen(filename.c_str(), "a");
+        if (out == NULL) {
+            error = "can't open " + filename + ": " + strerror(errno);
+            return false;
+        }
+        owned = true;
+    }
+
+    this->format = format;
+    this->verbosity = verbosity;
+    this->ratelimit = ratelimit;
+    head.store(0);
+    tail.store(0);
+    flushed.store(0);
+    stopping.store(false);
+    parked.store(false);
+    window = syncMetrics::wallNow();
+    memset(raised, 0, sizeof (raised));
+    memset(suppressed, 0, sizeof (suppressed));
+
+    writer = thread(&syncLog::drain, this);
+    started = true;
+
+    return true;
+}
+
+void syncLog::close() {
+    if (!started) {
+        return;
+    }
+
+    reportSuppressed();
+    stopping.store(true);
+    {
+        lock_guard<mutex> lock(idle);
+        wake.notify_one();
+    }
+    writer.join();
+    started = false;
+
+    if (owned) {
+        fclose(out);
+    } else {
+        fflush(out);
+    }
+    out = NULL;
+}
+
+log_event *syncLog::raise(log_category category, int id) {
+    if (!started || verbosity < categoryLevels[category]) {
+        return NULL;
+    }
+
+    if (ratelimit > 0) {
+        uint64_t now = syncMetrics::wallNow();
+
+        if (now - window >= 1000000000ULL) {
+            reportSuppressed();
+            memset(raised, 0, sizeof (raised));
+            window = now;
+        }
+        if (raised[category] >= ratelimit) {
+            suppressed[category]++;
+            return NULL;
+        }
+        raised[category]++;
+    }
+
+    return slot(category, id);
+}
+
+// Sequentially consistent against the writer's parked/head check, so
+// either the writer sees the new head or this sees it parked
+void syncLog::commit() {
+    head.store(head.load(memory_order_relaxed) + 1);
+    if (parked.load()) {
+        lock_guard<mutex> lock(idle);
+        wake.notify_one();
+    }
+}
+
+void syncLog::flush() {
+    if (!started) {
+        return;
+    }
+
+    reportSuppressed();
+
+    uint64_t target = head.load(memory_order_relaxed);
+    unique_lock<mutex> lock(idle);
+    while (flushed.load(memory_order_acquire) < target) {
+        drained.wait(lock);
+    }
+}
+
+// One SUPPRESSED event for each category that went over the rate limit
+void syncLog::reportSuppressed() {
+    for (int c = 0; c < LOG_CATEGORIES; c++) {
+        if (suppressed[c] == 0) {
+            continue;
+        }
+
+        log_event *e = slot(LOG_SUPPRESSED, 0);
+        e->next() = categoryName((log_category) c);
+        e->next() = to_string(suppressed[c]);
+        commit();
+        suppressed[c] = 0;
+    }
+}
+
+// The next free slot, waiting for the writer while the ring is full
+log_event *syncLog::slot(log_category category, int id) {
+    uint64_t h = head.load(memory_order_relaxed);
+    struct timespec now;
+
+    while (h - tail.load(memory_order_acquire) >= LOGRINGSIZE) {
+        this_thread::yield();
+    }
+
+    log_event &e = ring[h & (LOGRINGSIZE - 1)];
+    clock_gettime(CLOCK_REALTIME, &now);
+    e.category = category;
+    e.time = now.tv_sec + now.tv_nsec / 1e9;
+    e.id = id;
+    e.count = 0;
+
+    return &e;
+}
+
+// The writer thread: formats events as they come and writes them out in
+// blocks, flushing whenever the ring runs dry and then parking until the
+// next commit() or close()
+void syncLog::drain() {
+    bool unflushed = false;
+
+    while (true) {
+        uint64_t t = tail.load(memory_order_relaxed);
+        uint64_t h = head.load(memory_order_acquire);
+
+        if (t == h) {
+            if (!block.empty()) {
+                fwrite(block.data(), 1, block.length(), out);
+                block.clear();
+                unflushed = true;
+            }
+            if (unflushed) {
+                fflush(out);
+                unflushed = false;
+            }
+
+            unique_lock<mutex> lock(idle);
+            flushed.store(t, memory_order_release);
+            drained.notify_all();
+
+            parked.store(true);
+            while (head.load() == t && !stopping.load()) {
+                wake.wait(lock);
+            }
+            parked.store(false);
+            if (head.load() == t) {
+                return;
+            }
+            continue;
+        }
+
+        for (; t != h; t++) {
+            const log_event &e = ring[t & (LOGRINGSIZE - 1)];
+
+            if (format == LOG_JSON) {
+                formatJson(e);
+            } else {
+                formatText(e);
+            }
+            tail.store(t + 1, memory_order_release);
+
+            if (block.length() >= LOGBLOCKSIZE) {
+                fwrite(block.data(), 1, block.length(), out);
+                block.clear();
+                unflushed = true;
+            }
+        }
+    }
+}
+
+// The lines ordersync has always printed
+void syncLog::formatText(const log_event &e) {
+    const vector<string> &v = e.values;
+
+    switch (e.category) {
+        case LOG_NOTICE:
+            block += " " + v[0];
+            break;
+        case LOG_MALFORMED:
+            block += " MALFORMED " + v[0] + " : orddate [" + v[1] + "], exfdate [" + v[2] +
+                    "], orderqty [" + v[3] + "], quotaqty [" + v[4] + "]";
+            break;
+        case LOG_NOT_FOUND:
+            block += " IGNORE NOT FOUND - " + v[0] + " : [" + v[1] + "] " + v[2] + ", " + v[3] + ", " + v[4] +
+                    " = " + v[5] + ", " + v[6];
+            break;
+        case LOG_INSERT:
+            block += " NOT FOUND: INSERT " + flatten_key(v[1], v[2], v[3]);
+            break;
+        case LOG_UPDATE:
+        {
+            const char *separator = " : ";
+
+            block += " UPDATE " + v[0] + " at " + to_string(e.id);
+            for (size_t i = 1; i + 2 < e.count; i += 3) {
+                block += separator + v[i] + " " + v[i + 1] + " -> " + v[i + 2];
+                separator = ", ";
+            }
+            break;
+        }
+        case LOG_DELETE:
+            block += " DELETE " + v[0];
+            break;
+        case LOG_SUPPRESSED:
+            block += " SUPPRESSED " + v[1] + " " + v[0] + " events over the rate limit";
+            break;
+        case LOG_CATEGORIES:
+            break;
+    }
+    block += "\n";
+}
+
+// {"time":...,"event":"update","barcode_id":...,"id":...,"changes":{"quantity":{"from":"1","to":"2"}}}
+void syncLog::formatJson(const log_event &e) {
+    ostringstream stamp;
+    const char *const *names = valueNames[e.category];
+    size_t i = 0;
+
+    stamp << fixed << setprecision(3) << e.time;
+    block += "{\"time\":" + stamp.str() + ",\"event\":\"" + categoryName(e.category) + "\"";
+
+    for (; names[i] != NULL && i < e.count; i++) {
+        block += ",\"";
+        block += names[i];
+        block += "\":";
+        appendJson(e.values[i]);
+    }
+    if (e.category == LOG_UPDATE || e.category == LOG_DELETE) {
+        block += ",\"id\":" + to_string(e.id);
+    }
+    if (e.category == LOG_UPDATE) {
+        const char *separator = "";
+
+        block += ",\"changes\":{";
+        for (; i + 2 < e.count; i += 3) {
+            block += separator;
+            appendJson(e.values[i]);
+            block += ":{\"from\":";
+            appendJson(e.values[i + 1]);
+            block += ",\"to\":";
+            appendJson(e.values[i + 2]);
+            block += "}";
+            separator = ",";
+        }
+        block += "}";
+    }
+    block += "}\n";
+}
+
+// value as a JSON string; bytes other than quotes, backslashes and control
+// characters go through as they are
+void syncLog::appendJson(const string &value) {
+    static const char hex[] = "0123456789abcdef";
+
+    block += '"';
+    for (size_t i = 0; i < value.length(); i++) {
+        unsigned char c = value[i];
+
+        if (c == '"' || c == '\\') {
+            block += '\\';
+            block += c;
+        } else if (c < 0x20) {
+            block += "\\u00";
+            block += hex[c >> 4];
+            block += hex[c & 15];
+        } else {
+            block += c;
+        }
+    }
+    block += '"';
+}
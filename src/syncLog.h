@@ -0,0 +1,127 @@
+/*
+ * File:   syncLog.h
+ *
+ * The report of a sync: one typed event per change, skipped prosheet row
+ * or notice, written as the familiar text lines or as JSON lines.  The
+ * sync's thread only fills a slot of a lock-free single producer ring and
+ * moves on; a writer thread formats the events and writes them in large
+ * blocks, flushing whenever it runs out of events rather than per line.
+ * Out of events, the writer parks until commit() wakes it, which only
+ * takes the lock when the writer is actually parked.
+ *
+ * Events below the verbosity are dropped where they are raised, and so are
+ * those over the rate limit of their category (per second), which are
+ * counted and reported as suppressed once the second is over.
+ */
+
+#ifndef SYNCLOG_H
+#define SYNCLOG_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+// Ring slots; a full ring makes the sync wait for the writer
+#define LOGRINGSIZE 4096
+
+// Verbosity: every event up to its category's level is written
+#define LOGQUIET 0
+#define LOGNOTICES 1
+#define LOGALL 2
+
+enum log_category {
+    LOG_NOTICE, /* message */
+    LOG_MALFORMED, /* barcode_id, orddate, exfdate, orderqty, quotaqty */
+    LOG_NOT_FOUND, /* orddate, artcono, article, colorway, size, orderqty, kniprod */
+    LOG_INSERT, /* barcode_id, customer, orderno, item_id */
+    LOG_UPDATE, /* barcode_id, then column, from, to for each changed column */
+    LOG_DELETE, /* barcode_id */
+    LOG_SUPPRESSED, /* category name, count */
+    LOG_CATEGORIES
+};
+
+enum log_format {
+    LOG_TEXT,
+    LOG_JSON
+};
+
+struct log_event {
+    log_category category;
+    double time; /* Unix time */
+    int id; /* UPDATE, DELETE: the DB row */
+    size_t count; /* values in use; the strings past it keep their buffers for reuse */
+    vector<string> values;
+
+    // The next value, to be assigned in place
+    string &next() {
+        if (count == values.size()) {
+            values.push_back(string());
+        }
+        return values[count++];
+    }
+};
+
+class syncLog {
+private:
+    FILE *out;
+    bool owned; /* out was opened here */
+    log_format format;
+    int verbosity;
+    unsigned int ratelimit; /* Events per category and second, 0 for no limit */
+
+    vector<log_event> ring;
+    atomic<uint64_t> head; /* Next slot the sync fills */
+    atomic<uint64_t> tail; /* Next slot the writer takes */
+    atomic<uint64_t> flushed; /* Events written out and flushed */
+    atomic<bool> stopping;
+    atomic<bool> parked; /* The writer waits on wake for the next commit() */
+    mutex idle; /* Guards parking, and flushed for flush()'s waits */
+    condition_variable wake;
+    condition_variable drained; /* flushed moved on */
+    thread writer;
+    bool started;
+
+    // Rate limiting, on the sync's side
+    uint64_t window; /* Start of the current second */
+    unsigned int raised[LOG_CATEGORIES];
+    size_t suppressed[LOG_CATEGORIES];
+
+    string block; /* Formatted events not written yet, the writer's */
+
+public:
+    syncLog();
+    virtual ~syncLog();
+
+    // filename "" for stdout, otherwise appended to
+    bool open(const string &filename, log_format format, int verbosity, unsigned int ratelimit, string &error);
+    // Writes whatever is still queued and stops the writer
+    void close();
+
+    // A slot for an event of category, or NULL if it is not to be written;
+    // fill it and commit() it before raising another
+    log_event *raise(log_category category, int id = 0);
+    void commit();
+
+    // Returns once every event raised so far is written and flushed, e.g.
+    // before the sync writes to the same output itself
+    void flush();
+
+    static const char *categoryName(log_category category);
+
+private:
+    void reportSuppressed();
+    log_event *slot(log_category category, int id);
+    void drain();
+    void formatText(const log_event &e);
+    void formatJson(const log_event &e);
+    void appendJson(const string &value);
+};
+
+#endif /* SYNCLOG_H */
@@ -0,0 +1,218 @@
+/*
+ * File:   syncMetrics.cpp
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <sys/resource.h>
+
+#include "syncMetrics.h"
+
+static uint64_t clockNs(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t syncMetrics::wallNow() {
+    return clockNs(CLOCK_MONOTONIC);
+}
+
+uint64_t syncMetrics::cpuNow() {
+    return clockNs(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+stage_metrics &syncMetrics::stage(const string &name) {
+    map<string, stage_metrics>::iterator found = stages.find(name);
+
+    if (found == stages.end()) {
+        stage_metrics zero;
+
+        memset(&zero, 0, sizeof (zero));
+        found = stages.insert(make_pair(name, zero)).first;
+        stageorder.push_back(name);
+    }
+
+    return found->second;
+}
+
+void syncMetrics::addStage(const string &name, uint64_t wall_ns, uint64_t cpu_ns, uint64_t rows, uint64_t bytes) {
+    stage_metrics &s = stage(name);
+
+    s.calls++;
+    s.wall_ns += wall_ns;
+    s.cpu_ns += cpu_ns;
+    s.rows += rows;
+    s.bytes += bytes;
+}
+
+void syncMetrics::addLatency(const string &statement, uint64_t ns) {
+    map<string, latency_histogram>::iterator found = latencies.find(statement);
+    int bucket = 0;
+
+    if (found == latencies.end()) {
+        latency_histogram zero;
+
+        memset(&zero, 0, sizeof (zero));
+        found = latencies.insert(make_pair(statement, zero)).first;
+    }
+
+    for (uint64_t bound = 1000; bucket < METRICSBUCKETS && ns > bound; bound <<= 1) {
+        bucket++;
+    }
+
+    found->second.counts[bucket]++;
+    found->second.count++;
+    found->second.sum_ns += ns;
+}
+
+bool syncMetrics::write(const string &filename, metrics_format format, bool failed, string &error) {
+    if (format == METRICS_JSON) {
+        ofstream out(filename.c_str(), ios::app);
+
+        writeJson(out, failed);
+        out.close();
+        if (!out) {
+            error = "can't append to " + filename;
+            return false;
+        }
+        return true;
+    }
+
+    // node_exporter may read the textfile at any time, so it is replaced whole
+    string tmpname = filename + ".tmp";
+    ofstream out(tmpname.c_str(), ios::trunc);
+
+    writePrometheus(out, failed);
+    out.close();
+    if (!out || rename(tmpname.c_str(), filename.c_str()) != 0) {
+        remove(tmpname.c_str());
+        error = "can't write " + filename;
+        return false;
+    }
+    return true;
+}
+
+// One object per line: every stage, every statement class, then peak RSS
+// and the outcome, all stamped with the same unix time
+void syncMetrics::writeJson(ostream &out, bool failed) {
+    long stamp = time(NULL);
+
+    out << fixed << setprecision(6);
+    for (size_t i = 0; i < stageorder.size(); i++) {
+        const stage_metrics &s = stages[stageorder[i]];
+
+        out << "{\"time\":" << stamp << ",\"stage\":\"" << stageorder[i] << "\",\"calls\":" << s.calls
+                << ",\"wall_seconds\":" << s.wall_ns / 1e9 << ",\"cpu_seconds\":" << s.cpu_ns / 1e9
+                << ",\"rows\":" << s.rows << ",\"bytes\":" << s.bytes << "}\n";
+    }
+
+    for (map<string, latency_histogram>::iterator itr = latencies.begin(); itr != latencies.end(); ++itr) {
+        const latency_histogram &h = itr->second;
+
+        out << "{\"time\":" << stamp << ",\"statement\":\"" << itr->first << "\",\"count\":" << h.count
+                << ",\"sum_seconds\":" << h.sum_ns / 1e9 << ",\"buckets\":[";
+        for (int b = 0; b <= METRICSBUCKETS; b++) {
+            out << (b > 0 ? "," : "") << h.counts[b];
+        }
+        out << "]}\n";
+    }
+
+    out << "{\"time\":" << stamp << ",\"peak_rss_bytes\":" << peakRss() << ",\"status\":\""
+            << (failed ? "failed" : "ok") << "\"}" << endl;
+}
+
+void syncMetrics::writePrometheus(ostream &out, bool failed) {
+    static const char *const gauges[][2] = {
+        { "ordersync_stage_calls", "Times the stage ran in the last sync" },
+        { "ordersync_stage_wall_seconds", "Wall time spent in the stage in the last sync" },
+        { "ordersync_stage_cpu_seconds", "Process CPU time spent in the stage in the last sync" },
+        { "ordersync_stage_rows", "Rows the stage handled in the last sync" },
+        { "ordersync_stage_bytes", "Bytes the stage handled in the last sync" }
+    };
+
+    out << setprecision(9);
+    for (int g = 0; g < 5; g++) {
+        out << "# HELP " << gauges[g][0] << " " << gauges[g][1] << "\n"
+                << "# TYPE " << gauges[g][0] << " gauge\n";
+
+        for (size_t i = 0; i < stageorder.size(); i++) {
+            const stage_metrics &s = stages[stageorder[i]];
+            double value = 0;
+
+            switch (g) {
+                case 0: value = s.calls; break;
+                case 1: value = s.wall_ns / 1e9; break;
+                case 2: value = s.cpu_ns / 1e9; break;
+                case 3: value = s.rows; break;
+                case 4: value = s.bytes; break;
+            }
+            out << gauges[g][0] << "{stage=\"" << stageorder[i] << "\"} " << value << "\n";
+        }
+    }
+
+    out << "# HELP ordersync_statement_seconds Latency of the statements sent in the last sync\n"
+            << "# TYPE ordersync_statement_seconds histogram\n";
+    for (map<string, latency_histogram>::iterator itr = latencies.begin(); itr != latencies.end(); ++itr) {
+        const latency_histogram &h = itr->second;
+        uint64_t cumulative = 0;
+
+        for (int b = 0; b < METRICSBUCKETS; b++) {
+            cumulative += h.counts[b];
+            out << "ordersync_statement_seconds_bucket{statement=\"" << itr->first << "\",le=\""
+                    << (1ULL << b) / 1e6 << "\"} " << cumulative << "\n";
+        }
+        out << "ordersync_statement_seconds_bucket{statement=\"" << itr->first << "\",le=\"+Inf\"} " << h.count << "\n"
+                << "ordersync_statement_seconds_sum{statement=\"" << itr->first << "\"} " << h.sum_ns / 1e9 << "\n"
+                << "ordersync_statement_seconds_count{statement=\"" << itr->first << "\"} " << h.count << "\n";
+    }
+
+    out << "# HELP ordersync_peak_rss_bytes Peak resident set size of the process\n"
+            << "# TYPE ordersync_peak_rss_bytes gauge\n"
+            << "ordersync_peak_rss_bytes " << peakRss() << "\n"
+            << "# HELP ordersync_sync_failed 1 if the last sync failed, its stages being those it got through\n"
+            << "# TYPE ordersync_sync_failed gauge\n"
+            << "ordersync_sync_failed " << (failed ? 1 : 0) << endl;
+}
+
+uint64_t syncMetrics::peakRss() {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t) usage.ru_maxrss * 1024; // kilobytes on Linux
+}
+
+stageTimer::stageTimer(syncMetrics *metrics, const char *name) {
+    this->metrics = metrics;
+    this->name = name;
+    rows = 0;
+    bytes = 0;
+    if (metrics != NULL) {
+        wall = syncMetrics::wallNow();
+        cpu = syncMetrics::cpuNow();
+    }
+}
+
+stageTimer::~stageTimer() {
+    if (metrics != NULL) {
+        metrics->addStage(name, syncMetrics::wallNow() - wall, syncMetrics::cpuNow() - cpu, rows, bytes);
+    }
+}
+
+latencyTimer::latencyTimer(syncMetrics *metrics, const char *statement) {
+    this->metrics = metrics;
+    this->statement = statement;
+    if (metrics != NULL) {
+        started = syncMetrics::wallNow();
+    }
+}
+
+latencyTimer::~latencyTimer() {
+    if (metrics != NULL) {
+        metrics->addLatency(statement, syncMetrics::wallNow() - started);
+    }
+}
@@ -0,0 +1,103 @@
+/*
+ * File:   syncMetrics.h
+ *
+ * Where a sync spends its time.  Stages (connect, each reference load, the
+ * DBF scan, the deletes, commit, ...) accumulate wall and CPU time plus the
+ * rows and bytes they handled, and every statement sent to the server is
+ * timed into a latency histogram for its class.  A sync's worth is written
+ * out as JSON lines or as a Prometheus textfile, along with peak RSS and
+ * whether the sync failed (its stages then being those it got through).
+ */
+
+#ifndef SYNCMETRICS_H
+#define SYNCMETRICS_H
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+// Latency buckets: <= 1us, 2us, 4us, ... 2^(METRICSBUCKETS-1) us, then +Inf
+#define METRICSBUCKETS 24
+
+struct stage_metrics {
+    uint64_t calls;
+    uint64_t wall_ns;
+    uint64_t cpu_ns; /* Process CPU, so all threads count */
+    uint64_t rows;
+    uint64_t bytes;
+};
+
+struct latency_histogram {
+    uint64_t counts[METRICSBUCKETS + 1];
+    uint64_t count;
+    uint64_t sum_ns;
+};
+
+enum metrics_format {
+    METRICS_JSON,
+    METRICS_PROMETHEUS
+};
+
+class syncMetrics {
+private:
+    vector<string> stageorder; /* Stages in the order they first ran */
+    map<string, stage_metrics> stages;
+    map<string, latency_histogram> latencies;
+
+public:
+    static uint64_t wallNow();
+    static uint64_t cpuNow();
+
+    // Zeroed on first use; the reference stays valid
+    stage_metrics &stage(const string &name);
+    void addStage(const string &name, uint64_t wall_ns, uint64_t cpu_ns, uint64_t rows = 0, uint64_t bytes = 0);
+    void addLatency(const string &statement, uint64_t ns);
+
+    // JSON lines are appended to filename, a Prometheus textfile replaces it
+    bool write(const string &filename, metrics_format format, bool failed, string &error);
+
+private:
+    void writeJson(ostream &out, bool failed);
+    void writePrometheus(ostream &out, bool failed);
+    static uint64_t peakRss();
+};
+
+// Adds the time from construction to destruction to a stage; a NULL
+// metrics makes it a no-op
+class stageTimer {
+private:
+    syncMetrics *metrics;
+    const char *name;
+    uint64_t wall;
+    uint64_t cpu;
+    uint64_t rows;
+    uint64_t bytes;
+
+public:
+    stageTimer(syncMetrics *metrics, const char *name);
+    virtual ~stageTimer();
+
+    void count(uint64_t rows, uint64_t bytes = 0) {
+        this->rows += rows;
+        this->bytes += bytes;
+    }
+};
+
+// Adds the time from construction to destruction to a statement class'
+// latency histogram; a NULL metrics makes it a no-op
+class latencyTimer {
+private:
+    syncMetrics *metrics;
+    const char *statement;
+    uint64_t started;
+
+public:
+    latencyTimer(syncMetrics *metrics, const char *statement);
+    virtual ~latencyTimer();
+};
+
+#endif /* SYNCMETRICS_H */
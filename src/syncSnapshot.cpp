@@ -0,0 +1,229 @@
+/*
+ * File:   syncSnapshot.cpp
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "syncSnapshot.h"
+
+// Leads every snapshot file; bump the digit when the layout changes
+#define SNAPSHOTMAGIC "ORDSNAP2"
+#define SNAPSHOTMAGICSIZE 8
+
+syncSnapshot::syncSnapshot() {
+    recordcount = 0;
+    lastupdate = 0;
+    headerlength = 0;
+    recordlength = 0;
+    rowcount = 0;
+    xminsum = 0;
+    memset(database, 0, SNAPSHOTDIGESTSIZE);
+}
+
+void syncSnapshot::describe(dbfReader &reader, const string &dbstring) {
+    recordcount = reader.recordCount();
+    lastupdate = reader.lastUpdate();
+    headerlength = reader.headerLength();
+    recordlength = reader.recordLength();
+    sha.CalculateDigest(database, (const unsigned char *) dbstring.data(), dbstring.length());
+    groups.reserve(recordcount);
+}
+
+void syncSnapshot::add(const dbfSlice &barcode_id, const dbfSlice &record) {
+    snapshot_group *group = groups.find(&barcode_id);
+
+    if (group == NULL) {
+        snapshot_group empty;
+
+        empty.count = 0;
+        memset(empty.digest, 0, SNAPSHOTDIGESTSIZE);
+        groups.set(&barcode_id, empty);
+        group = groups.find(&barcode_id);
+    }
+
+    // Chained, so both the records and their order count
+    sha.Update(group->digest, SNAPSHOTDIGESTSIZE);
+    sha.Update((const unsigned char *) record.ptr, record.len);
+    sha.Final(group->digest);
+    group->count++;
+}
+
+// Little helpers for the fixed width fields, native byte order: a snapshot
+// never leaves the machine that wrote it
+
+template <typename T>
+static void put(string &dst, T value) {
+    dst.append((const char *) &value, sizeof (T));
+}
+
+template <typename T>
+static bool get(const string &src, size_t &pos, T &value) {
+    if (src.length() - pos < sizeof (T)) {
+        return false;
+    }
+    memcpy(&value, src.data() + pos, sizeof (T));
+    pos += sizeof (T);
+    return true;
+}
+
+static bool getBytes(const string &src, size_t &pos, void *dst, size_t len) {
+    if (src.length() - pos < len) {
+        return false;
+    }
+    memcpy(dst, src.data() + pos, len);
+    pos += len;
+    return true;
+}
+
+// Short strings, after their uint16 length
+static void putString(string &dst, const string &value) {
+    put(dst, (uint16_t) value.length());
+    dst.append(value, 0, (uint16_t) value.length());
+}
+
+static bool getString(const string &src, size_t &pos, string &value) {
+    uint16_t len;
+
+    if (!get(src, pos, len) || src.length() - pos < len) {
+        return false;
+    }
+    value.assign(src, pos, len);
+    pos += len;
+    return true;
+}
+
+bool syncSnapshot::load(const string &filename, string &error) {
+    ifstream in(filename.c_str(), ios::binary);
+    ostringstream contents;
+    unsigned char digest[SNAPSHOTDIGESTSIZE];
+    uint32_t groupcount;
+    size_t pos = SNAPSHOTMAGICSIZE;
+
+    if (!in) {
+        error = "no snapshot at " + filename;
+        return false;
+    }
+    contents << in.rdbuf();
+    string data = contents.str();
+
+    if (data.length() < SNAPSHOTMAGICSIZE + SNAPSHOTDIGESTSIZE || data.compare(0, SNAPSHOTMAGICSIZE, SNAPSHOTMAGIC) != 0) {
+        error = filename + " is not a snapshot";
+        return false;
+    }
+
+    size_t body = data.length() - SNAPSHOTDIGESTSIZE;
+    sha.CalculateDigest(digest, (const unsigned char *) data.data(), body);
+    if (memcmp(digest, data.data() + body, SNAPSHOTDIGESTSIZE) != 0) {
+        error = filename + " is corrupt";
+        return false;
+    }
+    data.resize(body);
+
+    if (!get(data, pos, recordcount) || !get(data, pos, lastupdate) ||
+            !get(data, pos, headerlength) || !get(data, pos, recordlength) ||
+            !getBytes(data, pos, database, SNAPSHOTDIGESTSIZE) ||
+            !get(data, pos, rowcount) || !get(data, pos, xminsum) || !getString(data, pos, itemversion) ||
+            !get(data, pos, groupcount)) {
+        error = filename + " is truncated";
+        return false;
+    }
+
+    groups.clear();
+    groups.reserve(groupcount);
+    for (uint32_t i = 0; i < groupcount; i++) {
+        uint8_t keylen;
+        snapshot_group group;
+        dbfSlice key;
+
+        if (!get(data, pos, keylen) || data.length() - pos < keylen) {
+            error = filename + " is truncated";
+            return false;
+        }
+        key.ptr = data.data() + pos;
+        key.len = keylen;
+        pos += keylen;
+
+        if (!get(data, pos, group.count) || !getBytes(data, pos, group.digest, SNAPSHOTDIGESTSIZE)) {
+            error = filename + " is truncated";
+            return false;
+        }
+        groups.set(&key, group);
+    }
+
+    if (pos != data.length()) {
+        error = filename + " has trailing data";
+        return false;
+    }
+
+    return true;
+}
+
+bool syncSnapshot::save(const string &filename, string &error) {
+    string data(SNAPSHOTMAGIC);
+    unsigned char digest[SNAPSHOTDIGESTSIZE];
+    string tmpname = filename + ".tmp";
+
+    put(data, recordcount);
+    put(data, lastupdate);
+    put(data, headerlength);
+    put(data, recordlength);
+    data.append((const char *) database, SNAPSHOTDIGESTSIZE);
+    put(data, rowcount);
+    put(data, xminsum);
+    putString(data, itemversion);
+    put(data, (uint32_t) groups.size());
+
+    for (group_index::iterator itr = groups.begin(); itr != groups.end(); ++itr) {
+        dbfSlice key = itr.key(0);
+
+        put(data, (uint8_t) key.len); // barcode_id is at most 8 bytes
+        key.appendTo(data);
+        put(data, itr.value().count);
+        data.append((const char *) itr.value().digest, SNAPSHOTDIGESTSIZE);
+    }
+
+    sha.CalculateDigest(digest, (const unsigned char *) data.data(), data.length());
+    data.append((const char *) digest, SNAPSHOTDIGESTSIZE);
+
+    FILE *out = fopen(tmpname.c_str(), "wb");
+    if (out == NULL) {
+        error = "can't create " + tmpname;
+        return false;
+    }
+    bool written = fwrite(data.data(), 1, data.length(), out) == data.length();
+    if (fclose(out) != 0 || !written) {
+        remove(tmpname.c_str());
+        error = "can't write " + tmpname;
+        return false;
+    }
+    if (rename(tmpname.c_str(), filename.c_str()) != 0) {
+        remove(tmpname.c_str());
+        error = "can't replace " + filename;
+        return false;
+    }
+
+    return true;
+}
+
+string syncSnapshot::staleness(const syncSnapshot &current) const {
+    if (headerlength != current.headerlength || recordlength != current.recordlength) {
+        return "prosheet.DBF layout changed";
+    }
+    if (memcmp(database, current.database, SNAPSHOTDIGESTSIZE) != 0) {
+        return "snapshot belongs to another database";
+    }
+    if (current.lastupdate < lastupdate) {
+        return "prosheet.DBF is older than the snapshot";
+    }
+    if (current.rowcount != rowcount || current.xminsum != xminsum) {
+        return "production:order_content changed outside ordersync";
+    }
+    // Rows skipped as not found may have an item now, and found ones another
+    if (current.itemversion != itemversion) {
+        return "the sock tables changed";
+    }
+
+    return "";
+}
@@ -0,0 +1,86 @@
+/*
+ * File:   syncSnapshot.h
+ *
+ * What prosheet.DBF looked like at the last successful sync: one SHA-1 per
+ * barcode_id, chained over the raw bytes of every record carrying it (in
+ * file order), plus the header facts, a fingerprint of the order_content
+ * the sync left behind and the version of the sock tables it looked items
+ * up in.  Comparing it with the snapshot of the current file tells which
+ * barcodes need to be decoded and reconciled again, as long as nothing but
+ * prosheet.DBF changed since.
+ *
+ * On disk it is a small header, the groups, and a SHA-1 of everything
+ * before it; a snapshot that fails to load for any reason only means a full
+ * sync.
+ */
+
+#ifndef SYNCSNAPSHOT_H
+#define SYNCSNAPSHOT_H
+
+#include <string>
+#include <stdint.h>
+#include <cryptopp/sha.h>
+
+#include "dbfReader.h"
+#include "flatHash.h"
+
+using namespace std;
+
+#define SNAPSHOTDIGESTSIZE CryptoPP::SHA1::DIGESTSIZE
+
+// The records sharing one barcode_id
+struct snapshot_group {
+    uint32_t count;
+    unsigned char digest[SNAPSHOTDIGESTSIZE];
+
+    bool operator==(const snapshot_group &other) const {
+        return count == other.count && memcmp(digest, other.digest, SNAPSHOTDIGESTSIZE) == 0;
+    }
+
+    bool operator!=(const snapshot_group &other) const {
+        return !(*this == other);
+    }
+};
+
+class syncSnapshot {
+public:
+    typedef flatHash<snapshot_group, 1> group_index;
+
+    // prosheet.DBF header
+    uint32_t recordcount;
+    int32_t lastupdate;
+    uint32_t headerlength;
+    uint32_t recordlength;
+
+    // Fingerprint of the database the snapshot was synced into
+    unsigned char database[SNAPSHOTDIGESTSIZE];
+    // production:order_content right after that sync: its row count and the
+    // sum of its rows' xmin, which any write to it moves
+    uint32_t rowcount;
+    int64_t xminsum;
+    // item_version() of the sock tables that sync looked items up in
+    string itemversion;
+
+    group_index groups;
+
+    syncSnapshot();
+
+    // Take the header facts from an open reader
+    void describe(dbfReader &reader, const string &dbstring);
+    // Fold the current record into its barcode's group
+    void add(const dbfSlice &barcode_id, const dbfSlice &record);
+
+    // false (with the reason) if filename is missing, unreadable or corrupt
+    bool load(const string &filename, string &error);
+    // Written next to filename and renamed over it, so a crash never leaves half a snapshot
+    bool save(const string &filename, string &error);
+
+    // Why this snapshot can't stand in for the DB state behind current (with
+    // the fingerprint and item version of the DB as it is now), or "" if it can
+    string staleness(const syncSnapshot &current) const;
+
+private:
+    CryptoPP::SHA1 sha;
+};
+
+#endif /* SYNCSNAPSHOT_H */
@@ -0,0 +1,96 @@
+/*
+ * File:   textUtil.cpp
+ */
+
+#include <cctype>
+#include <cstring>
+
+#include "textUtil.h"
+
+// trims parenthesis and all blanks
+string trim(string str) {
+    string tmp(str.length(), ' ');
+
+    tmp.resize(trimInto(str.data(), str.length(), &tmp[0]));
+
+    return tmp;
+}
+
+// Text at parenthesis depth 0 is kept (a stray ')' takes the depth below
+// 0 until a '(' brings it back), then blanks are trimmed at both ends
+size_t trimInto(const char *src, size_t len, char *dst) {
+    int l = 0;
+    size_t kept = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (src[i] == '(') l++;
+        else if (src[i] == ')') l--;
+        else if (l == 0) {
+            dst[kept++] = src[i];
+        }
+    }
+
+    size_t first = 0;
+    while (first < kept && isspace((unsigned char) dst[first])) {
+        first++;
+    }
+    while (kept > first && isspace((unsigned char) dst[kept - 1])) {
+        kept--;
+    }
+    if (first > 0) {
+        memmove(dst, dst + first, kept - first);
+    }
+
+    return kept - first;
+}
+
+string flatten_key(string artcono, string color, string size) {
+    return artcono + "|||" + color + "|||" + size;
+}
+
+// yyyymmdd -> yyyy-mm-dd, 0 (blank date) -> ""
+void isoDate(string &dst, int32_t date) {
+    char buf[10];
+
+    if (date == 0) {
+        dst.clear();
+        return;
+    }
+
+    buf[9] = '0' + date % 10;
+    buf[8] = '0' + date / 10 % 10;
+    buf[7] = '-';
+    buf[6] = '0' + date / 100 % 10;
+    buf[5] = '0' + date / 1000 % 10;
+    buf[4] = '-';
+    buf[3] = '0' + date / 10000 % 10;
+    buf[2] = '0' + date / 100000 % 10;
+    buf[1] = '0' + date / 1000000 % 10;
+    buf[0] = '0' + date / 10000000 % 10;
+
+    dst.assign(buf, 10);
+}
+
+// yyyy-mm-dd (a PostgreSQL date in the ISO DateStyle) -> yyyymmdd, "" -> 0
+bool packDate(const char *str, size_t len, int32_t &date) {
+    date = 0;
+    if (len == 0) {
+        return true;
+    }
+    if (len != 10 || str[4] != '-' || str[7] != '-') {
+        return false;
+    }
+
+    for (size_t i = 0; i < 10; i++) {
+        if (i == 4 || i == 7) {
+            continue;
+        }
+        if (str[i] < '0' || str[i] > '9') {
+            date = 0;
+            return false;
+        }
+        date = date * 10 + (str[i] - '0');
+    }
+
+    return true;
+}
@@ -0,0 +1,27 @@
+/*
+ * File:   textUtil.h
+ *
+ * Small text helpers shared by ordersync and the benchmarks.
+ */
+
+#ifndef TEXTUTIL_H
+#define TEXTUTIL_H
+
+#include <string>
+#include <stdint.h>
+
+using namespace std;
+
+// trims parenthesis and all blanks
+string trim(string str);
+// The same into dst, which must hold len bytes; no allocation
+// return: the trimmed length
+size_t trimInto(const char *src, size_t len, char *dst);
+string flatten_key(string artcono, string color, string size);
+// yyyymmdd -> yyyy-mm-dd, 0 (blank date) -> ""
+void isoDate(string &dst, int32_t date);
+// yyyy-mm-dd (a PostgreSQL date in the ISO DateStyle) -> yyyymmdd, "" -> 0;
+// false if str is neither
+bool packDate(const char *str, size_t len, int32_t &date);
+
+#endif /* TEXTUTIL_H */